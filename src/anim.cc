@@ -9,13 +9,11 @@
 #include "skyrenderer.h"
 #include "perlin.h"
 #include "colorbuffer.h"
+#include "dispatch.h"
 #include "getopt.h"
 
 using namespace std;
 
-// macro for int -> str conversion
-#define SSTR( x ) dynamic_cast< std::ostringstream & >( ( std::ostringstream() << std::dec << x ) ).str()
-
 struct param_struct       // command line argument values
   {
     double time;
@@ -29,13 +27,18 @@ struct param_struct       // command line argument values
     unsigned int supersampling;
     double clouds;        // how many clouds there are in range <0,1>
     double cloud_density;
+    bool seeded;          // whether the seeded table noise is used instead of the legacy one
+    unsigned int seed;
+    bool octave_lod;      // whether the far clouds leave out the aliasing octaves
+    perlin_noise_type noise_type;
+    perlin_octave_preset octaves;
   } params;
 
 void print_help()
   {
      cout << "Skygen generates sky animations." << endl << endl;
      cout << "usage:" << endl << endl;
-     cout << "skygen [[-t time][-d duration][-f frames][-o name][-c amount][-e density][-x width][-y height][-p level][-s] | [-h]]" << endl << endl;
+     cout << "skygen [[-t time][-d duration][-f frames][-o name][-c amount][-e density][-x width][-y height][-p level][-r seed][-n type][-q octaves][-l][-s] | [-h]]" << endl << endl;
      cout << "  -t specifies the day time, time is in HH:MM 24 hour format, for example 0:15, 12:00, 23:45. Default value is 12:00." << endl << endl;
      cout << "  -d specifies duration in minutes from the specified day time. If for example -t 12:00 -d 60 is set, the animation will be genrated from 12:00 to 13:00. If this flag is omitted, the whole animation will be generated at the same time of the day and will loop smoothly." << endl << endl;
      cout << "  -f specifies the number of frames of the animation. Default value is 1." << endl;
@@ -45,6 +48,10 @@ void print_help()
      cout << "  -p sets the supersampling level." << endl << endl;
      cout << "  -c say how many clouds there should be. amount is a whole number in range <0,100>." << endl << endl;
      cout << "  -e sets the cloud density. density is a whole number in range <0,100>." << endl << endl;
+     cout << "  -r sets the noise seed, seed is a whole number. Each seed gives different clouds. If this flag is omitted, the original noise is used and the clouds are the same as in the previous versions." << endl << endl;
+     cout << "  -n sets the noise type of the clouds, type is value (default) or simplex." << endl << endl;
+     cout << "  -q sets the noise octaves, octaves is fast (less detail), default or high (more detail)." << endl << endl;
+     cout << "  -l turns on the octave level of detail, the far clouds leave out the finest noise octaves that would only alias. This is faster and shimmers less in animations, but the clouds differ slightly from the default ones." << endl << endl;
      cout << "  -s sets the silent mode, nothing will be written during rendering." << endl << endl;
      cout << "  -h prints help." << endl;
   }
@@ -63,6 +70,11 @@ void parse_command_line_arguments(int argc, char **argv)
     params.height = 768;
     params.silent = false;
     params.supersampling = 1;
+    params.seeded = false;
+    params.seed = 0;
+    params.octave_lod = false;
+    params.noise_type = PERLIN_NOISE_VALUE;
+    params.octaves = PERLIN_OCTAVES_DEFAULT;
 
     int i = 0;
     string helper_string;
@@ -109,6 +121,20 @@ void parse_command_line_arguments(int argc, char **argv)
               params.cloud_density = saturate_int(atoi(argv[i + 1]),0,100) / 100.0;
             else if (helper_string == "-y")
               params.height = saturate_int(atoi(argv[i + 1]),0,65536);
+            else if (helper_string == "-n")
+              params.noise_type = string(argv[i + 1]) == "simplex" ? PERLIN_NOISE_SIMPLEX : PERLIN_NOISE_VALUE;
+            else if (helper_string == "-q")
+              {
+                string octaves = argv[i + 1];
+
+                params.octaves = octaves == "fast" ? PERLIN_OCTAVES_FAST : octaves == "high" ? PERLIN_OCTAVES_HIGH :
+                  PERLIN_OCTAVES_DEFAULT;
+              }
+            else if (helper_string == "-r")
+              {
+                params.seeded = true;
+                params.seed = strtoul(argv[i + 1],NULL,10);
+              }
             else
               i--;
 
@@ -117,6 +143,8 @@ void parse_command_line_arguments(int argc, char **argv)
 
         if (helper_string == "-s")
           params.silent = true;
+        else if (helper_string == "-l")
+          params.octave_lod = true;
         else if (helper_string == "-h")
           params.help = true;
 
@@ -140,6 +168,15 @@ int main(int argc, char **argv)
         return 0;
       }
 
+    dispatch_init();
+
+    if (params.seeded)
+      perlin_init(params.seed);
+
+    renderer.set_octave_lod(params.octave_lod);
+    perlin_set_noise_type(params.noise_type);
+    perlin_set_octave_preset(params.octaves);
+
     color_buffer_init(&buffer,params.width * params.supersampling,params.height * params.supersampling);
 
     step = params.duration / params.frames;        // step in time
@@ -166,7 +203,7 @@ int main(int argc, char **argv)
         if (params.duration == 0.0)        // hopefully this is safe
           noise_offset += noise_step;
 
-        filename = params.frames == 1 ? params.name + ".png" : params.name + SSTR(i + 1) + ".png";
+        filename = params.frames == 1 ? params.name + ".png" : params.name + to_string(i + 1) + ".png";
 
         SDL_UpdateTexture(sdlTexture, NULL, buffer.data, params.width*4);
         SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
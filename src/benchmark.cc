@@ -0,0 +1,677 @@
+#include "benchmark.h"
+#include <iostream>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "perlin.h"
+
+using namespace std;
+
+static const perlin_noise_type noise_types[2] = {PERLIN_NOISE_VALUE, PERLIN_NOISE_SIMPLEX};
+static const char *noise_type_names[2] = {"value", "simplex"};
+
+static double seconds_since(chrono::steady_clock::time_point start)
+  {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+static unsigned long picture_hash(t_color_buffer *buffer)
+  {
+    unsigned long hash = 14695981039346656037UL;     // FNV-1a of the whole picture
+
+    for (unsigned int i = 0; i < 4 * buffer->width * buffer->height; i++)
+      hash = (hash ^ buffer->data[i]) * 1099511628211UL;
+
+    return hash;
+  }
+
+void benchmark_noise(unsigned int samples)
+  {
+    vector<float> x(samples), y(samples), z(samples), out(samples);
+    unsigned int i, k;
+    float z_slice = 0.3 * PERLIN_WIDTH;
+    volatile float sink = 0;    // keeps the single samples from being optimised away
+
+    // samples along lines of a sky plane like the renderer takes them,
+    // about a pixel apart
+    for (i = 0; i < samples; i++)
+      {
+        x[i] = (i % 1024) * 0.7;
+        y[i] = ((i / 1024) % 1024) * 0.7 + 0.25 * (i % 1024) / 1024.0;
+        z[i] = z_slice;
+      }
+
+    perlin_noise_type previous = perlin_get_noise_type();
+
+    cout << "noise (ns per sample):" << endl;
+
+    for (k = 0; k < 2; k++)
+      {
+        perlin_set_noise_type(noise_types[k]);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (i = 0; i < samples; i++)
+          sink = sink + perlin(x[i],y[i],z[i]);
+
+        double single = seconds_since(start);
+
+        start = chrono::steady_clock::now();
+        perlin_batch(x.data(),y.data(),z.data(),out.data(),samples);
+        double batch = seconds_since(start);
+
+        start = chrono::steady_clock::now();
+        perlin_slice slice(z_slice);
+        double slice_setup = seconds_since(start);
+
+        start = chrono::steady_clock::now();
+        slice.sample_batch(x.data(),y.data(),out.data(),samples);
+        double slice_batch = seconds_since(start);
+
+        cout << "  " << noise_type_names[k] << ": perlin " << single * 1e9 / samples << ", perlin_batch "
+          << batch * 1e9 / samples << ", perlin_slice " << slice_batch * 1e9 / samples << " (+ "
+          << slice_setup * 1e3 << " ms setup)" << endl;
+      }
+
+    perlin_set_noise_type(previous);
+  }
+
+void benchmark_rays(sky_renderer *renderer, unsigned int width, unsigned int height)
+  {
+    vector<prepared_triangle> *planes[2] = {renderer->get_geometry(0)->get_triangles(),
+      renderer->get_geometry(1)->get_triangles()};
+    vector<unsigned int> all_triangles[2];
+    vector<line_3D> lines;
+    vector<ray_packet> packets;
+    vector<packet_hits> packet_hits_out;
+    vector<unsigned char> sun;
+    double barycentric_a, barycentric_b, barycentric_c, line_t, closest_t, scalar = 0, packet = 0;
+    unsigned int i, j, k, l;
+    unsigned long hits = 0;
+    volatile unsigned long sink = 0;   // keeps the results from being optimised away
+    sphere_3D sphere;
+
+    sphere.center = point_3D(0,6,-1);    // the sun at noon
+    sphere.radius = 0.5;
+
+    for (l = 0; l < 2; l++)   // the packets are intersected with all the triangles, like the lines
+      for (k = 0; k < planes[l]->size(); k++)
+        all_triangles[l].push_back(k);
+
+    for (j = 0; j < height; j++)   // the rays are made line by line, only the intersections are measured
+      {
+        lines.clear();
+        packets.clear();
+
+        for (i = 0; i < width; i++)
+          {
+            lines.push_back(renderer->pixel_ray(i,j,width,height));
+            add_ray(&packets,point_3D(),lines.back().get_point(1.0));
+          }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (i = 0; i < width; i++)
+          {
+            for (l = 0; l < 2; l++)
+              {
+                closest_t = HUGE_VAL;
+
+                for (k = 0; k < planes[l]->size(); k++)
+                  if (lines[i].intersects_triangle(&(*planes[l])[k],barycentric_a,barycentric_b,barycentric_c,line_t)
+                    && line_t < closest_t)
+                    closest_t = line_t;
+
+                hits += closest_t != HUGE_VAL;
+              }
+
+            hits += lines[i].intersects_sphere(sphere);
+          }
+
+        scalar += seconds_since(start);
+        start = chrono::steady_clock::now();
+
+        packet_hits_out.resize(packets.size());
+        sun.resize(packets.size() * RAY_PACKET_SIZE);
+
+        for (l = 0; l < 2; l++)
+          {
+            closest_triangle_hits(planes[l],all_triangles[l].data(),all_triangles[l].size(),packets.data(),
+              packets.size(),packet_hits_out.data());
+
+            for (i = 0; i < width; i++)
+              hits += packet_hits_out[i / RAY_PACKET_SIZE].hit[i % RAY_PACKET_SIZE] >= 0;
+          }
+
+        sphere_hits(sphere,packets.data(),packets.size(),sun.data());
+
+        for (i = 0; i < width; i++)
+          hits += sun[i];
+
+        packet += seconds_since(start);
+      }
+
+    sink = sink + hits;
+
+    cout << "primary rays (" << width << " x " << height << ", both sky planes and the sun, millions of rays per second):" << endl;
+    cout << "  scalar " << width * height / scalar * 1e-6 << ", packets of " << RAY_PACKET_SIZE << " "
+      << width * height / packet * 1e-6 << endl;
+  }
+
+// rozdeli kazdy trojuhelnik na ctyri
+static void subdivide_triangles(vector<triangle_3D> *triangles)
+  {
+    vector<triangle_3D> result;
+
+    for (unsigned int i = 0; i < triangles->size(); i++)
+      {
+        triangle_3D *t = &(*triangles)[i];
+        point_3D ab((t->a.x + t->b.x) / 2,(t->a.y + t->b.y) / 2,(t->a.z + t->b.z) / 2);
+        point_3D bc((t->b.x + t->c.x) / 2,(t->b.y + t->c.y) / 2,(t->b.z + t->c.z) / 2);
+        point_3D ca((t->c.x + t->a.x) / 2,(t->c.y + t->a.y) / 2,(t->c.z + t->a.z) / 2);
+        point_3D ab_t((t->a_t.x + t->b_t.x) / 2,(t->a_t.y + t->b_t.y) / 2,0);
+        point_3D bc_t((t->b_t.x + t->c_t.x) / 2,(t->b_t.y + t->c_t.y) / 2,0);
+        point_3D ca_t((t->c_t.x + t->a_t.x) / 2,(t->c_t.y + t->a_t.y) / 2,0);
+
+        result.push_back(triangle_3D(t->a,ab,ca,t->a_t,ab_t,ca_t));
+        result.push_back(triangle_3D(ab,t->b,bc,ab_t,t->b_t,bc_t));
+        result.push_back(triangle_3D(ca,bc,t->c,ca_t,bc_t,t->c_t));
+        result.push_back(triangle_3D(ab,bc,ca,ab_t,bc_t,ca_t));
+      }
+
+    *triangles = result;
+  }
+
+void benchmark_geometry(sky_renderer *renderer, unsigned int width, unsigned int height, unsigned int levels)
+  {
+    vector<triangle_3D> lower_plane, upper_plane;
+    vector<unsigned int> all_triangles, candidates;
+    vector<ray_packet> packets;
+    vector<packet_hits> packet_hits_out;
+    double barycentric_a, barycentric_b, barycentric_c, line_t;
+    unsigned int i, j, level, tile_x, tile_y;
+    unsigned long hits = 0;
+    volatile unsigned long sink = 0;   // keeps the results from being optimised away
+    triangle_bvh bvh;
+
+    renderer->setup_sky_planes(&lower_plane,&upper_plane);
+
+    cout << "sky plane geometry (" << width << " x " << height << ", millions of rays per second):" << endl;
+
+    for (level = 0; level <= levels; level++)
+      {
+        if (level != 0)
+          subdivide_triangles(&lower_plane);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bvh.build(&lower_plane);
+        double build = seconds_since(start);
+
+        vector<prepared_triangle> *triangles = bvh.get_triangles();
+
+        all_triangles.clear();
+
+        for (i = 0; i < triangles->size(); i++)
+          all_triangles.push_back(i);
+
+        double linear = 0, scalar = 0, tiles = 0;
+
+        // each ray with all the triangles in packets, the renderer without the BVH
+
+        for (j = 0; j < height; j++)
+          {
+            packets.clear();
+
+            for (i = 0; i < width; i++)
+              add_ray(&packets,point_3D(),renderer->pixel_ray(i,j,width,height).get_direction());
+
+            packet_hits_out.resize(packets.size());
+
+            start = chrono::steady_clock::now();
+            closest_triangle_hits(triangles,all_triangles.data(),all_triangles.size(),packets.data(),packets.size(),
+              packet_hits_out.data());
+            linear += seconds_since(start);
+
+            for (i = 0; i < width; i++)
+              hits += packet_hits_out[i / RAY_PACKET_SIZE].hit[i % RAY_PACKET_SIZE] >= 0;
+          }
+
+        // one line at a time down the BVH
+
+        start = chrono::steady_clock::now();
+
+        for (j = 0; j < height; j++)
+          for (i = 0; i < width; i++)
+            {
+              line_3D line = renderer->pixel_ray(i,j,width,height);
+
+              hits += bvh.closest_hit(&line,barycentric_a,barycentric_b,barycentric_c,line_t) >= 0;
+            }
+
+        scalar = seconds_since(start);
+
+        // the tiles of the renderer, the packets of each tile line with the triangles of the tile frustum
+
+        for (tile_y = 0; tile_y < height; tile_y += TILE_SIZE)
+          for (tile_x = 0; tile_x < width; tile_x += TILE_SIZE)
+            {
+              unsigned int x1 = min(tile_x + TILE_SIZE,width) - 1, y1 = min(tile_y + TILE_SIZE,height) - 1;
+              point_3D directions[4] = {renderer->pixel_ray(tile_x,tile_y,width,height).get_direction(),
+                renderer->pixel_ray(x1,tile_y,width,height).get_direction(),
+                renderer->pixel_ray(x1,y1,width,height).get_direction(),
+                renderer->pixel_ray(tile_x,y1,width,height).get_direction()};
+
+              start = chrono::steady_clock::now();
+              bvh.frustum_triangles(point_3D(),directions,&candidates);
+              tiles += seconds_since(start);
+
+              for (j = tile_y; j <= y1; j++)
+                {
+                  packets.clear();
+
+                  for (i = tile_x; i <= x1; i++)
+                    add_ray(&packets,point_3D(),renderer->pixel_ray(i,j,width,height).get_direction());
+
+                  packet_hits_out.resize(packets.size());
+
+                  start = chrono::steady_clock::now();
+                  closest_triangle_hits(triangles,candidates.data(),candidates.size(),packets.data(),
+                    packets.size(),packet_hits_out.data());
+                  tiles += seconds_since(start);
+
+                  for (i = 0; i <= x1 - tile_x; i++)
+                    hits += packet_hits_out[i / RAY_PACKET_SIZE].hit[i % RAY_PACKET_SIZE] >= 0;
+                }
+            }
+
+        cout << "  " << triangles->size() << " triangles: all in packets " << width * height / linear * 1e-6
+          << ", BVH per line " << width * height / scalar * 1e-6 << ", BVH tiles in packets "
+          << width * height / tiles * 1e-6 << " (+ " << build * 1e3 << " ms build)" << endl;
+      }
+
+    sink = sink + hits;
+  }
+
+void benchmark_blur(unsigned int width, unsigned int height)
+  {
+    t_color_buffer original, buffers[2];
+    unsigned int radius, i, k;
+    const t_blur_method methods[2] = {BLUR_RUNNING_SUM, BLUR_SUMMED_AREA};
+
+    color_buffer_init(&original,width,height);
+
+    srand(10);
+
+    for (i = 0; i < width * height * 4; i++)
+      original.data[i] = i % 4 == 3 ? 0xff : rand() % 256;
+
+    cout << "box blur (" << width << " x " << height << ", ms, running sum / summed-area table):" << endl;
+
+    for (radius = 4; radius <= 64; radius *= 4)
+      {
+        double times[2];
+
+        for (k = 0; k < 2; k++)
+          {
+            color_buffer_copy(&original,&buffers[k]);
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            color_buffer_box_blur(&buffers[k],radius,0,0,width,height,methods[k]);
+            times[k] = seconds_since(start);
+          }
+
+        bool same = memcmp(buffers[0].data,buffers[1].data,width * height * 4) == 0;
+
+        cout << "  radius " << radius << ": " << times[0] * 1e3 << " / " << times[1] * 1e3
+          << (same ? "" : " (the pictures differ)") << endl;
+
+        color_buffer_destroy(&buffers[0]);
+        color_buffer_destroy(&buffers[1]);
+      }
+
+    color_buffer_destroy(&original);
+  }
+
+void benchmark_frames(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, unsigned int frames)
+  {
+    t_color_buffer buffer;
+    unsigned int i, k;
+
+    color_buffer_init(&buffer,width,height);
+
+    perlin_noise_type previous = perlin_get_noise_type();
+
+    cout << "frames (" << width << " x " << height << ", ms per frame):" << endl;
+
+    for (k = 0; k < 2; k++)
+      {
+        perlin_set_noise_type(noise_types[k]);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (i = 0; i < frames; i++)
+          renderer->render_sky(&buffer,time_of_day,clouds,density,i / ((double) frames));
+
+        cout << "  " << noise_type_names[k] << ": " << seconds_since(start) * 1e3 / frames << endl;
+      }
+
+    perlin_set_noise_type(previous);
+    color_buffer_destroy(&buffer);
+  }
+
+void benchmark_precision(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, unsigned int frames)
+  {
+    t_color_buffer reference, buffer;
+    unsigned int i, j, k, largest = 0;
+    unsigned long differing[2] = {0, 0};   // components that differ by one, by more
+    double times[2] = {0, 0};
+
+    color_buffer_init(&reference,width,height);
+    color_buffer_init(&buffer,width,height);
+
+    render_precision previous = renderer->get_precision();
+
+    for (i = 0; i < frames; i++)
+      {
+        renderer->set_precision(PRECISION_DOUBLE);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        renderer->render_sky(&reference,time_of_day,clouds,density,i / ((double) frames));
+        times[0] += seconds_since(start);
+
+        renderer->set_precision(PRECISION_FLOAT);
+        start = chrono::steady_clock::now();
+        renderer->render_sky(&buffer,time_of_day,clouds,density,i / ((double) frames));
+        times[1] += seconds_since(start);
+
+        for (j = 0; j < width * height; j++)
+          {
+            unsigned char colors[2][3];
+
+            color_buffer_get_pixel(&reference,j % width,j / width,&colors[0][0],&colors[0][1],&colors[0][2]);
+            color_buffer_get_pixel(&buffer,j % width,j / width,&colors[1][0],&colors[1][1],&colors[1][2]);
+
+            for (k = 0; k < 3; k++)
+              {
+                unsigned int difference = abs(colors[0][k] - colors[1][k]);
+
+                largest = max(largest,difference);
+
+                if (difference != 0)
+                  differing[difference == 1 ? 0 : 1]++;
+              }
+          }
+      }
+
+    renderer->set_precision(previous);
+
+    double components = 3.0 * width * height * frames;
+
+    cout << "float precision (" << width << " x " << height << "):" << endl;
+    cout << "  ms per frame: double " << times[0] * 1e3 / frames << ", float " << times[1] * 1e3 / frames << endl;
+    cout << "  difference from double: at most " << largest << ", " << 100.0 * differing[0] / components
+      << " % of the color components by 1, " << 100.0 * differing[1] / components << " % by more" << endl;
+
+    color_buffer_destroy(&reference);
+    color_buffer_destroy(&buffer);
+  }
+
+bool benchmark_threads(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density)
+  {
+    t_color_buffer buffer;
+    const unsigned int runs = 7;
+    int counts[runs] = {1, 2, 4, 8, 16, 64, omp_get_max_threads()};
+    unsigned long hashes[runs];
+    double times[runs];
+    unsigned int i, j;
+    bool same = true;
+
+    color_buffer_init(&buffer,width,height);
+
+    renderer->render_sky(&buffer,time_of_day,clouds,density,0);   // so that the first one doesn't build the caches
+
+    cout << "threads (" << width << " x " << height << "):" << endl;
+
+    for (i = 0; i < runs; i++)
+      {
+        omp_set_num_threads(counts[i]);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        renderer->render_sky(&buffer,time_of_day,clouds,density,0);
+        times[i] = seconds_since(start);
+
+        hashes[i] = picture_hash(&buffer);
+        same = same && hashes[i] == hashes[0];
+
+        render_statistics statistics = renderer->get_statistics();
+        double busy_min = statistics.busy_time[0], busy_max = 0, busy_sum = 0;
+
+        for (j = 0; j < statistics.busy_time.size(); j++)         // the team may be smaller than asked for
+          {
+            busy_min = min(busy_min,statistics.busy_time[j]);
+            busy_max = max(busy_max,statistics.busy_time[j]);
+            busy_sum += statistics.busy_time[j];
+          }
+
+        cout << "  " << counts[i];
+
+        if (statistics.busy_time.size() != (unsigned int) counts[i])
+          cout << " (got " << statistics.busy_time.size() << ")";
+
+        cout << ": ms per frame " << times[i] * 1e3 << ", speedup " << times[0] / times[i] << ", ms busy per thread "
+          << busy_min * 1e3 << " to " << busy_max * 1e3 << " (mean " << busy_sum * 1e3 / statistics.busy_time.size() << "), "
+          << statistics.stolen_tiles << " steals, hash " << hex << hashes[i] << dec << endl;
+      }
+
+    omp_set_num_threads(counts[runs - 1]);
+
+    cout << "  pictures " << (same ? "the same" : "DIFFER") << endl;
+
+    color_buffer_destroy(&buffer);
+
+    return same;
+  }
+
+bool benchmark_simd(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, simd_level max_level)
+  {
+    const unsigned int samples = 1 << 16;
+    const char *mode_names[3] = {"default", "ray planes", "stencil glow"};
+    vector<float> x(samples), y(samples), z(samples);
+    vector<float> noise[2];                    // of the generic kernels, of the tested ones
+    vector<unsigned char> buffers[2];
+    unsigned long hashes[2][3];
+    t_color_buffer original, mask, buffer, small;
+    sky_renderer renderers[3] = {*renderer, *renderer, *renderer};
+    unsigned int i, k, level;
+    bool same = true;
+
+    renderers[1].set_ray_traced_planes(true);
+    renderers[2].set_stencil_glow(true);
+
+    for (i = 0; i < samples; i++)      // like in benchmark_noise()
+      {
+        x[i] = (i % 1024) * 0.7;
+        y[i] = ((i / 1024) % 1024) * 0.7 + 0.25 * (i % 1024) / 1024.0;
+        z[i] = 0.3 * PERLIN_WIDTH;
+      }
+
+    color_buffer_init(&original,width,height);
+    color_buffer_init(&mask,width,height);
+    color_buffer_init(&buffer,width,height);
+
+    srand(10);
+
+    for (i = 0; i < width * height * 4; i++)
+      {
+        original.data[i] = i % 4 == 3 ? 0xff : rand() % 256;
+        mask.data[i] = rand() % 256;
+      }
+
+    perlin_noise_type previous = perlin_get_noise_type();
+
+    cout << "simd levels (" << width << " x " << height << ", compared with generic):" << endl;
+
+    for (level = SIMD_GENERIC; level <= dispatch_cpu_level(); level++)
+      {
+        unsigned int tested = level == SIMD_GENERIC ? 0 : 1;
+
+        dispatch_init((simd_level) level);
+
+        noise[tested].clear();
+
+        for (k = 0; k < 2; k++)
+          {
+            perlin_set_noise_type(noise_types[k]);
+
+            perlin_slice slice(z[0]);
+            size_t start = noise[tested].size();
+
+            noise[tested].resize(start + 2 * samples);
+            perlin_batch(x.data(),y.data(),z.data(),noise[tested].data() + start,samples);
+            slice.sample_batch(x.data(),y.data(),noise[tested].data() + start + samples,samples);
+          }
+
+        perlin_set_noise_type(previous);
+
+        supersampling(&original,2,&small);
+        color_buffer_copy_data(&original,&buffer);
+        color_buffer_add_inverted(&buffer,&mask,0.75,0,height,0,width);
+
+        buffers[tested].assign(small.data,small.data + 4 * small.width * small.height);
+        buffers[tested].insert(buffers[tested].end(),buffer.data,buffer.data + 4 * width * height);
+
+        color_buffer_destroy(&small);
+
+        for (k = 0; k < 3; k++)
+          {
+            renderers[k].render_sky(&buffer,time_of_day,clouds,density,0);
+            hashes[tested][k] = picture_hash(&buffer);
+          }
+
+        if (level == SIMD_GENERIC)
+          continue;
+
+        bool same_noise = noise[0] == noise[1];
+        bool same_buffers = buffers[0] == buffers[1];
+
+        same = same && same_noise && same_buffers;
+
+        cout << "  " << simd_level_name((simd_level) level) << ": noise " << (same_noise ? "the same" : "DIFFERS")
+          << ", supersampling and stencil " << (same_buffers ? "the same" : "DIFFER");
+
+        for (k = 0; k < 3; k++)
+          {
+            same = same && hashes[0][k] == hashes[1][k];
+            cout << ", " << mode_names[k] << " frame " << (hashes[0][k] == hashes[1][k] ? "the same" : "DIFFERS");
+          }
+
+        cout << endl;
+      }
+
+    dispatch_init(max_level);
+
+    cout << "  results " << (same ? "the same" : "DIFFER") << endl;
+
+    color_buffer_destroy(&original);
+    color_buffer_destroy(&mask);
+    color_buffer_destroy(&buffer);
+
+    return same;
+  }
+
+bool benchmark_packets(sky_renderer *renderer, unsigned int width, unsigned int height, simd_level max_level)
+  {
+    vector<prepared_triangle> *planes[2] = {renderer->get_geometry(0)->get_triangles(),
+      renderer->get_geometry(1)->get_triangles()};
+    vector<unsigned int> all_triangles[2];
+    vector<line_3D> lines;
+    vector<ray_packet> packets;
+    vector<packet_hits> hits;
+    vector<unsigned char> sun;
+    vector<long long> scalar_hits[2];
+    vector<double> scalar_t[2], scalar_b[2], scalar_c[2];
+    vector<unsigned char> scalar_sun;
+    double barycentric_a, barycentric_b, barycentric_c, line_t;
+    unsigned int i, j, k, l, level;
+    bool same = true;
+    sphere_3D sphere;
+
+    sphere.center = point_3D(0,6,-1);    // the sun at noon, like in benchmark_rays()
+    sphere.radius = 0.5;
+
+    for (l = 0; l < 2; l++)
+      for (k = 0; k < planes[l]->size(); k++)
+        all_triangles[l].push_back(k);
+
+    for (j = 0; j < height; j++)          // the scalar results, the closest hit of each line, the lowest index of the equally close ones
+      for (i = 0; i < width; i++)
+        {
+          lines.push_back(renderer->pixel_ray(i,j,width,height));
+          add_ray(&packets,point_3D(),lines.back().get_point(1.0));
+
+          for (l = 0; l < 2; l++)
+            {
+              scalar_hits[l].push_back(-1);
+              scalar_t[l].push_back(HUGE_VAL);
+              scalar_b[l].push_back(0);
+              scalar_c[l].push_back(0);
+
+              for (k = 0; k < planes[l]->size(); k++)
+                if (lines.back().intersects_triangle(&(*planes[l])[k],barycentric_a,barycentric_b,barycentric_c,line_t)
+                  && line_t < scalar_t[l].back())
+                  {
+                    scalar_hits[l].back() = k;
+                    scalar_t[l].back() = line_t;
+                    scalar_b[l].back() = barycentric_b;
+                    scalar_c[l].back() = barycentric_c;
+                  }
+            }
+
+          scalar_sun.push_back(lines.back().intersects_sphere(sphere));
+        }
+
+    hits.resize(packets.size());
+    sun.resize(packets.size() * RAY_PACKET_SIZE);
+
+    cout << "ray packets (" << width << " x " << height << ", rays differing from the scalar test):" << endl;
+
+    for (level = SIMD_GENERIC; level <= dispatch_cpu_level(); level++)
+      {
+        unsigned long differing = 0;
+
+        dispatch_init((simd_level) level);
+
+        for (l = 0; l < 2; l++)
+          {
+            closest_triangle_hits(planes[l],all_triangles[l].data(),all_triangles[l].size(),packets.data(),
+              packets.size(),hits.data());
+
+            for (i = 0; i < lines.size(); i++)
+              {
+                packet_hits *packet = &hits[i / RAY_PACKET_SIZE];
+                unsigned int lane = i % RAY_PACKET_SIZE;
+
+                differing += packet->hit[lane] != scalar_hits[l][i] || (scalar_hits[l][i] >= 0 &&
+                  (packet->t[lane] != scalar_t[l][i] || packet->b[lane] != scalar_b[l][i] ||
+                  packet->c[lane] != scalar_c[l][i]));
+              }
+          }
+
+        sphere_hits(sphere,packets.data(),packets.size(),sun.data());
+
+        for (i = 0; i < lines.size(); i++)
+          differing += sun[i] != scalar_sun[i];
+
+        same = same && differing == 0;
+
+        cout << "  " << simd_level_name((simd_level) level) << ": " << differing << endl;
+      }
+
+    dispatch_init(max_level);
+
+    return same;
+  }
@@ -0,0 +1,145 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "skyrenderer.h"
+#include "dispatch.h"
+
+/**<
+ Performance measurements printed by skygen --benchmark.
+ */
+
+void benchmark_noise(unsigned int samples);
+  /**<
+    Measures how long one noise sample takes with each noise type, for
+    single perlin() calls, perlin_batch() and a perlin_slice (used by the
+    renderer), and prints the times in ns per sample.
+
+    @param samples number of samples of each measurement
+    */
+
+void benchmark_rays(sky_renderer *renderer, unsigned int width, unsigned int height);
+  /**<
+    Intersects the primary rays of a frame with all the triangles of the
+    sky planes and the sun, one line_3D at a time and in ray packets,
+    and prints the speed of both in millions of rays per second.
+
+    @param renderer renderer whose rays and sky planes are used
+    @param width width of the frame
+    @param height height of the frame
+    */
+
+void benchmark_geometry(sky_renderer *renderer, unsigned int width, unsigned int height, unsigned int levels);
+  /**<
+    Intersects the primary rays of a frame with the lower default sky
+    plane split into more and more triangles, each ray with all of them
+    in packets, one line at a time down a triangle_bvh and by the tiles
+    of the renderer (the packets of a tile with the triangles of its
+    frustum), and prints the speeds in millions of rays per second.
+
+    @param renderer renderer whose rays and sky planes are used
+    @param width width of the frame
+    @param height height of the frame
+    @param levels how many times the triangles are split into four, the
+           last plane has 2 * 4^levels triangles
+    */
+
+void benchmark_blur(unsigned int width, unsigned int height);
+  /**<
+    Box blurs a whole noisy frame with both methods of
+    color_buffer_box_blur() and growing radii, and prints the times in ms
+    and whether the two methods give the same picture.
+
+    @param width width of the frame
+    @param height height of the frame
+    */
+
+void benchmark_frames(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, unsigned int frames);
+  /**<
+    Renders a few frames with each noise type and prints the average frame
+    time. The pictures are thrown away.
+
+    @param renderer renderer to render the frames with
+    @param width width of the frames
+    @param height height of the frames
+    @param time_of_day time of day in range <0,1>, see render_sky
+    @param clouds how many clouds there are, see render_sky
+    @param density cloud density, see render_sky
+    @param frames number of frames rendered with each noise type
+    */
+
+void benchmark_precision(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, unsigned int frames);
+  /**<
+    Renders a few frames in the double and the float precision (see
+    sky_renderer::set_precision), prints the average frame times and how
+    much the float pictures differ from the double ones, the largest
+    difference of a color component and the share of the differing ones.
+
+    @param renderer renderer to render the frames with, its precision is
+           restored at the end
+    @param width width of the frames
+    @param height height of the frames
+    @param time_of_day time of day in range <0,1>, see render_sky
+    @param clouds how many clouds there are, see render_sky
+    @param density cloud density, see render_sky
+    @param frames number of frames rendered with each precision
+    */
+
+bool benchmark_threads(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density);
+  /**<
+    Renders the same frame with 1, 2, 4, 8, 16, 64 and all the available
+    threads, prints the frame time, the speedup, how long the threads
+    were busy with the tiles, how many times they stole tiles and a hash
+    of the picture for each and whether the pictures are the same, as
+    they have to be.
+
+    @param renderer renderer to render the frames with
+    @param width width of the frames
+    @param height height of the frames
+    @param time_of_day time of day in range <0,1>, see render_sky
+    @param clouds how many clouds there are, see render_sky
+    @param density cloud density, see render_sky
+    @return true if all the pictures are the same, false otherwise
+    */
+
+bool benchmark_simd(sky_renderer *renderer, unsigned int width, unsigned int height, double time_of_day,
+  double clouds, double density, simd_level max_level);
+  /**<
+    Runs the noise, supersampling and stencil kernels and renders a frame
+    in the default and both reference modes (see
+    sky_renderer::set_ray_traced_planes and set_stencil_glow) with each
+    SIMD level the CPU has, and prints whether the results are the same as
+    with the generic kernels, as they have to be.
+
+    @param renderer renderer to render the frames with, it is copied
+    @param width width of the frames
+    @param height height of the frames
+    @param time_of_day time of day in range <0,1>, see render_sky
+    @param clouds how many clouds there are, see render_sky
+    @param density cloud density, see render_sky
+    @param max_level the level the kernels are selected for again at the
+           end
+    @return true if all the results are the same, false otherwise
+    */
+
+bool benchmark_packets(sky_renderer *renderer, unsigned int width, unsigned int height, simd_level max_level);
+  /**<
+    Intersects the primary rays of a frame with all the triangles of the
+    sky planes and the sun in ray packets (closest_triangle_hits,
+    sphere_hits) with each SIMD level the CPU has and one line_3D at a
+    time, and prints for each level how many rays got a different hit,
+    parameter value or barycentric coordinates than the scalar
+    Moller-Trumbore test, there must be none.
+
+    @param renderer renderer whose rays and sky planes are used
+    @param width width of the frame
+    @param height height of the frame
+    @param max_level the level the kernels are selected for again at the
+           end
+    @return true if all the packet results are the same as the scalar
+            ones, false otherwise
+    */
+
+#endif
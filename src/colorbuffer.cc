@@ -8,8 +8,16 @@
 
 #include "colorbuffer.h"
 #include "lodepng.h"
+#include "dispatch.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define COLOR_BUFFER_X86
+#endif
+
+#define PNG_CHUNK_SIZE (256 << 10)   ///< bytes of the filtered scanlines each thread deflates at once
 
 //----------------------------------------------------------------------
 
@@ -30,11 +38,8 @@ unsigned char round_to_char(int value)
 void color_buffer_clear(t_color_buffer *buffer)
 
   {
-    unsigned int i,j;
-
-    for (j = 0; j < buffer->height; j++)
-      for (i = 0; i < buffer->width; i++)
-        color_buffer_set_pixel(buffer,i,j,255,255,255);
+    // white with the 0xff alpha that color_buffer_set_pixel writes
+    memset(buffer->data,255,buffer->width * buffer->height * 4);
   }
 
 //----------------------------------------------------------------------
@@ -201,11 +206,171 @@ int color_buffer_init(t_color_buffer *buffer, int width, int height)
 
 //----------------------------------------------------------------------
 
+/*
+ * The PNG scanlines are deflated in parallel in chunks, like pigz does.
+ * Each chunk starts with the LZ77 window filled with the end of the
+ * previous one, so the compression is almost as good as in one piece,
+ * and all but the last end with a sync flush, so that they join into one
+ * deflate stream. The Adler-32 checksums of the chunks are combined. The
+ * chunks don't depend on the number of threads, so neither does the
+ * file.
+ */
+
+static unsigned adler32_combine(unsigned adler1, unsigned adler2,
+  size_t length2)
+
+  {
+    const unsigned base = 65521;
+    unsigned remainder = length2 % base;
+    unsigned sum1 = adler1 & 0xffff;
+    unsigned sum2 = (remainder * (unsigned long) sum1) % base;
+
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - remainder;
+
+    if (sum1 >= base)
+      sum1 -= base;
+
+    if (sum1 >= base)
+      sum1 -= base;
+
+    if (sum2 >= 2 * base)
+      sum2 -= 2 * base;
+
+    if (sum2 >= base)
+      sum2 -= base;
+
+    return sum1 | (sum2 << 16);
+  }
+
+//----------------------------------------------------------------------
+
+static unsigned parallel_zlib_compress(unsigned char **out, size_t *outsize,
+  const unsigned char *in, size_t insize,
+  const LodePNGCompressSettings *settings)
+
+  {
+    if (insize < 2 * PNG_CHUNK_SIZE || (settings->btype != 1 && settings->btype != 2))
+      return lodepng_zlib_compress(out,outsize,in,insize,settings);
+
+    int chunks = (insize + PNG_CHUNK_SIZE - 1) / PNG_CHUNK_SIZE;
+    unsigned char **data = (unsigned char **) calloc(chunks,sizeof(unsigned char *));
+    size_t *sizes = (size_t *) calloc(chunks,sizeof(size_t));
+    unsigned *adlers = (unsigned *) malloc(chunks * sizeof(unsigned));
+    unsigned error = 0;
+    int i;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < chunks; i++)
+      {
+        size_t start = i * (size_t) PNG_CHUNK_SIZE;
+        size_t end = start + PNG_CHUNK_SIZE < insize ? start + PNG_CHUNK_SIZE : insize;
+        unsigned chunk_error = lodepng_deflate_chunk(&data[i],&sizes[i],in,start,end,i == chunks - 1,settings);
+
+        adlers[i] = lodepng_adler32(in + start,end - start);
+
+        if (chunk_error != 0)
+          {
+            #pragma omp critical(png_chunks)
+            error = chunk_error;
+          }
+      }
+
+    size_t length = 2 + 4;           // zlib header and checksum
+    unsigned adler = adlers[0];
+
+    for (i = 0; i < chunks; i++)
+      {
+        length += sizes[i];
+
+        if (i > 0)
+          adler = adler32_combine(adler,adlers[i],(i == chunks - 1 ? insize : (i + 1) * (size_t) PNG_CHUNK_SIZE) - i * (size_t) PNG_CHUNK_SIZE);
+      }
+
+    unsigned char *output = error == 0 ? (unsigned char *) realloc(*out,*outsize + length) : NULL;
+
+    if (output == NULL && error == 0)
+      error = 83;                    // lodepng's allocation error
+
+    if (error == 0)
+      {
+        unsigned char *position = output + *outsize;
+        unsigned header = 256 * 120; // deflate with a 32K window, like lodepng_zlib_compress
+
+        header += 31 - header % 31;
+        *position++ = header >> 8;
+        *position++ = header & 0xff;
+
+        for (i = 0; i < chunks; i++)
+          {
+            memcpy(position,data[i],sizes[i]);
+            position += sizes[i];
+          }
+
+        *position++ = adler >> 24;
+        *position++ = (adler >> 16) & 0xff;
+        *position++ = (adler >> 8) & 0xff;
+        *position++ = adler & 0xff;
+
+        *out = output;
+        *outsize += length;
+      }
+
+    for (i = 0; i < chunks; i++)
+      free(data[i]);
+
+    free(data);
+    free(sizes);
+    free(adlers);
+
+    return error;
+  }
+
+//----------------------------------------------------------------------
+
 int color_buffer_save_to_png(t_color_buffer *buffer, char *filename)
 
   {
-    if (lodepng_encode32_file(filename,buffer->data,
-      buffer->width,buffer->height) == 0)
+    unsigned char *png = NULL;
+    size_t size = 0;
+    int result = color_buffer_encode_png(buffer,&png,&size) &&
+      color_buffer_write_png(png,size,filename);
+
+    free(png);
+    return result;
+  }
+
+//----------------------------------------------------------------------
+
+int color_buffer_encode_png(t_color_buffer *buffer, unsigned char **png,
+  size_t *size)
+
+  {
+    LodePNGState state;   // like lodepng_encode32(), with the parallel deflate
+    unsigned error;
+
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+    state.info_png.color.colortype = LCT_RGBA;
+    state.info_png.color.bitdepth = 8;
+    state.encoder.zlibsettings.custom_zlib = parallel_zlib_compress;
+
+    *png = NULL;
+    *size = 0;
+    lodepng_encode(png,size,buffer->data,buffer->width,buffer->height,&state);
+    error = state.error;
+    lodepng_state_cleanup(&state);
+
+    return error == 0 ? 1 : 0;
+  }
+
+//----------------------------------------------------------------------
+
+int color_buffer_write_png(unsigned char *png, size_t size, char *filename)
+
+  {
+    if (lodepng_save_file(png,size,filename) == 0)
       return 1;
     else
       return 0;
@@ -225,40 +390,390 @@ int color_buffer_load_from_png(t_color_buffer *buffer, char *filename)
 
 //----------------------------------------------------------------------
 
-void supersampling(t_color_buffer *buffer, unsigned int level,
-  t_color_buffer *destination)
+/*
+ * The row kernels below are written once and inlined into a function for
+ * each instruction set, the compiler vectorizes each of them for its own
+ * set. The pixels are RGBA, alpha is always 0xff.
+ */
+
+static inline __attribute__((always_inline)) void add_inverted_body(
+  unsigned char *data, const unsigned char *mask, double intensity,
+  unsigned int pixels)
 
   {
-    unsigned int i, j, k, l, sum_red, sum_green, sum_blue;
-    unsigned char red, green, blue;
+    int values[256];   // the added value for each mask value
 
-    color_buffer_init(destination,buffer->width / level,
-      buffer->height / level);
+    for (int i = 0; i < 256; i++)
+      values[i] = (int) ((255 - i) * intensity);
 
-    for (j = 0; j < destination->height; j++)
-      for (i = 0; i < destination->width; i++)
-        {
-          sum_red = 0;
-          sum_green = 0;
-          sum_blue = 0;
+    #pragma omp simd
+    for (size_t i = 0; i < pixels; i++)
+      {
+        int value = values[mask[4 * i]];
+        int red = data[4 * i] + value;
+        int green = data[4 * i + 1] + value;
+        int blue = data[4 * i + 2] + value;
+
+        data[4 * i] = red > 255 ? 255 : red;
+        data[4 * i + 1] = green > 255 ? 255 : green;
+        data[4 * i + 2] = blue > 255 ? 255 : blue;
+        data[4 * i + 3] = 0xff;
+      }
+  }
+
+//----------------------------------------------------------------------
+
+static inline __attribute__((always_inline)) void supersampling_body(
+  const unsigned char *source, unsigned int source_width,
+  unsigned char *destination, unsigned int width, unsigned int level)
+
+  {
+    unsigned int divisor = level * level;
+
+    #pragma omp simd
+    for (size_t i = 0; i < width; i++)
+      {
+        unsigned int sum_red = 0, sum_green = 0, sum_blue = 0;
+
+        for (size_t l = 0; l < level; l++)
+          for (size_t k = 0; k < level; k++)
+            {
+              const unsigned char *pixel = source +
+                4 * (l * source_width + level * i + k);
+
+              sum_red += pixel[0];
+              sum_green += pixel[1];
+              sum_blue += pixel[2];
+            }
+
+        destination[4 * i] = sum_red / divisor;       // average
+        destination[4 * i + 1] = sum_green / divisor;
+        destination[4 * i + 2] = sum_blue / divisor;
+        destination[4 * i + 3] = 0xff;
+      }
+  }
+
+//----------------------------------------------------------------------
+
+static void add_inverted_generic(unsigned char *data,
+  const unsigned char *mask, double intensity, unsigned int pixels)
+
+  {
+    add_inverted_body(data,mask,intensity,pixels);
+  }
+
+static void supersampling_generic(const unsigned char *source,
+  unsigned int source_width, unsigned char *destination,
+  unsigned int width, unsigned int level)
+
+  {
+    supersampling_body(source,source_width,destination,width,level);
+  }
+
+#ifdef COLOR_BUFFER_X86
+
+static __attribute__((target("avx2"))) void add_inverted_avx2(
+  unsigned char *data, const unsigned char *mask, double intensity,
+  unsigned int pixels)
+
+  {
+    add_inverted_body(data,mask,intensity,pixels);
+  }
+
+static __attribute__((target("avx2"))) void supersampling_avx2(
+  const unsigned char *source, unsigned int source_width,
+  unsigned char *destination, unsigned int width, unsigned int level)
+
+  {
+    supersampling_body(source,source_width,destination,width,level);
+  }
+
+static __attribute__((target("avx512f"))) void add_inverted_avx512(
+  unsigned char *data, const unsigned char *mask, double intensity,
+  unsigned int pixels)
+
+  {
+    add_inverted_body(data,mask,intensity,pixels);
+  }
+
+static __attribute__((target("avx512f"))) void supersampling_avx512(
+  const unsigned char *source, unsigned int source_width,
+  unsigned char *destination, unsigned int width, unsigned int level)
+
+  {
+    supersampling_body(source,source_width,destination,width,level);
+  }
+
+#endif
+
+static void (*add_inverted_kernel)(unsigned char *data,
+  const unsigned char *mask, double intensity, unsigned int pixels) =
+  add_inverted_generic;
+
+static void (*supersampling_kernel)(const unsigned char *source,
+  unsigned int source_width, unsigned char *destination,
+  unsigned int width, unsigned int level) = supersampling_generic;
 
-          for (k = 0; k < level; k++)          // get 4 x 4 area pixels sums
-            for (l = 0; l < level; l++)
+//----------------------------------------------------------------------
+
+void color_buffer_dispatch(simd_level level)
+
+  {
+    simd_level selected = SIMD_GENERIC;
+
+    add_inverted_kernel = add_inverted_generic;
+    supersampling_kernel = supersampling_generic;
+
+#ifdef COLOR_BUFFER_X86
+    if (level >= SIMD_AVX512)
+      {
+        add_inverted_kernel = add_inverted_avx512;
+        supersampling_kernel = supersampling_avx512;
+        selected = SIMD_AVX512;
+      }
+    else if (level >= SIMD_AVX2)
+      {
+        add_inverted_kernel = add_inverted_avx2;
+        supersampling_kernel = supersampling_avx2;
+        selected = SIMD_AVX2;
+      }
+#endif
+
+    dispatch_record("color_buffer_add_inverted",selected);
+    dispatch_record("supersampling",selected);
+  }
+
+//----------------------------------------------------------------------
+
+void color_buffer_add_inverted(t_color_buffer *buffer,
+  t_color_buffer *mask, double intensity, unsigned int from_row,
+  unsigned int to_row, unsigned int from_column, unsigned int to_column)
+
+  {
+    for (unsigned int j = from_row; j < to_row; j++)
+      add_inverted_kernel(buffer->data + 4 * (j * buffer->width + from_column),
+        mask->data + 4 * (j * mask->width + from_column),intensity,
+        to_column - from_column);
+  }
+
+//----------------------------------------------------------------------
+
+static inline int clamp_coordinate(int value, int size)
+
+  {
+    return value < 0 ? 0 : (value >= size ? size - 1 : value);
+  }
+
+//----------------------------------------------------------------------
+
+static void box_blur_running_sum(t_color_buffer *buffer, int radius,
+  int x0, int y0, int x1, int y1, unsigned int *rows)
+
+  {
+    /* The window sums of the rows from y0 - radius to y1 + radius
+       (clamped to the buffer) are made by a running sum along each row,
+       the columns of these sums then by a running sum down each block
+       of output rows. */
+
+    int width = x1 - x0;
+    int from_row = clamp_coordinate(y0 - radius,buffer->height);
+    int to_row = clamp_coordinate(y1 - 1 + radius,buffer->height) + 1;
+    unsigned int divisor = (2 * radius + 1) * (2 * radius + 1);
+
+    #pragma omp parallel
+      {
+        #pragma omp for
+        for (int j = from_row; j < to_row; j++)
+          {
+            unsigned char *line = buffer->data + 4 * j * buffer->width;
+            unsigned int *sums = rows + 3 * (j - from_row) * width;
+            unsigned int sum[3] = {0, 0, 0};
+
+            for (int k = x0 - radius; k <= x0 + radius; k++)
+              for (int c = 0; c < 3; c++)
+                sum[c] += line[4 * clamp_coordinate(k,buffer->width) + c];
+
+            for (int i = 0; i < width; i++)
+              {
+                unsigned char *in = line + 4 * clamp_coordinate(x0 + i + radius + 1,buffer->width);
+                unsigned char *out = line + 4 * clamp_coordinate(x0 + i - radius,buffer->width);
+
+                for (int c = 0; c < 3; c++)
+                  {
+                    sums[3 * i + c] = sum[c];
+                    sum[c] += in[c] - out[c];
+                  }
+              }
+          }
+
+        // each thread slides down its own rows, starting anew where they aren't consecutive
+
+        unsigned int *sum = (unsigned int *) malloc(3 * width * sizeof(unsigned int));
+        int previous = y0 - 2;
+
+        #pragma omp for schedule(static)
+        for (int j = y0; j < y1; j++)
+          {
+            unsigned char *line = buffer->data + 4 * j * buffer->width;
+
+            if (j != previous + 1)
+              {
+                memset(sum,0,3 * width * sizeof(unsigned int));
+
+                for (int k = j - radius; k <= j + radius; k++)
+                  {
+                    unsigned int *sums = rows + 3 * (clamp_coordinate(k,buffer->height) - from_row) * width;
+
+                    for (int i = 0; i < 3 * width; i++)
+                      sum[i] += sums[i];
+                  }
+              }
+            else
               {
-                color_buffer_get_pixel(buffer,(level * i) + k,
-                  (level * j) + l,&red,&green,&blue);
+                unsigned int *in = rows + 3 * (clamp_coordinate(j + radius,buffer->height) - from_row) * width;
+                unsigned int *out = rows + 3 * (clamp_coordinate(j - radius - 1,buffer->height) - from_row) * width;
 
-                sum_red += red;
-                sum_green += green;
-                sum_blue += blue;
+                for (int i = 0; i < 3 * width; i++)
+                  sum[i] += in[i] - out[i];
               }
 
-          red = sum_red / (level * level);     // average
-          green = sum_green / (level * level);
-          blue = sum_blue / (level * level);
+            for (int i = 0; i < width; i++)
+              {
+                for (int c = 0; c < 3; c++)
+                  line[4 * (x0 + i) + c] = sum[3 * i + c] / divisor;
 
-          color_buffer_set_pixel(destination,i,j,red,green,blue);
-        }
+                line[4 * (x0 + i) + 3] = 0xff;
+              }
+
+            previous = j;
+          }
+
+        free(sum);
+      }
+  }
+
+//----------------------------------------------------------------------
+
+static void box_blur_summed_area(t_color_buffer *buffer, int radius,
+  int x0, int y0, int x1, int y1, unsigned int *table)
+
+  {
+    /* The table covers the rectangle extended by the radius, with the
+       pixels out of the buffer clamped, and a zero row and column before
+       it. The sums may overflow, but a window sum is small and the
+       unsigned differences still give it exactly. */
+
+    int width = x1 - x0 + 2 * radius + 1;
+    int height = y1 - y0 + 2 * radius + 1;
+    unsigned int divisor = (2 * radius + 1) * (2 * radius + 1);
+
+    #pragma omp parallel
+      {
+        #pragma omp for
+        for (int j = 0; j < height; j++)
+          {
+            unsigned int *sums = table + 3 * j * width;
+
+            if (j == 0)
+              {
+                memset(sums,0,3 * width * sizeof(unsigned int));
+                continue;
+              }
+
+            unsigned char *line = buffer->data + 4 * clamp_coordinate(y0 - radius + j - 1,buffer->height) * buffer->width;
+
+            sums[0] = 0; sums[1] = 0; sums[2] = 0;
+
+            for (int i = 1; i < width; i++)
+              {
+                unsigned char *pixel = line + 4 * clamp_coordinate(x0 - radius + i - 1,buffer->width);
+
+                for (int c = 0; c < 3; c++)
+                  sums[3 * i + c] = sums[3 * (i - 1) + c] + pixel[c];
+              }
+          }
+
+        // down the columns, in blocks so that the rows are read in order
+
+        #pragma omp for
+        for (int block = 0; block < 3 * width; block += 256)
+          for (int j = 1; j < height; j++)
+            {
+              unsigned int *sums = table + 3 * j * width;
+              int block_end = block + 256 < 3 * width ? block + 256 : 3 * width;
+
+              for (int i = block; i < block_end; i++)
+                sums[i] += sums[i - 3 * width];
+            }
+
+        #pragma omp for
+        for (int j = y0; j < y1; j++)
+          {
+            unsigned char *line = buffer->data + 4 * j * buffer->width;
+            unsigned int *top = table + 3 * (j - y0) * width;
+            unsigned int *bottom = table + 3 * (j - y0 + 2 * radius + 1) * width;
+
+            for (int i = 0; i < x1 - x0; i++)
+              {
+                int left = 3 * i;
+                int right = 3 * (i + 2 * radius + 1);
+
+                for (int c = 0; c < 3; c++)
+                  line[4 * (x0 + i) + c] = (bottom[right + c] - top[right + c] -
+                    bottom[left + c] + top[left + c]) / divisor;
+
+                line[4 * (x0 + i) + 3] = 0xff;
+              }
+          }
+      }
+  }
+
+//----------------------------------------------------------------------
+
+int color_buffer_box_blur(t_color_buffer *buffer, unsigned int radius,
+  unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1,
+  t_blur_method method)
+
+  {
+    unsigned int *sums;
+    size_t length;
+
+    if (radius == 0 || x0 >= x1 || y0 >= y1)
+      return 1;
+
+    if (method == BLUR_SUMMED_AREA)
+      length = (size_t) (x1 - x0 + 2 * radius + 1) * (y1 - y0 + 2 * radius + 1);
+    else
+      length = (size_t) (x1 - x0) * (y1 - y0 + 2 * radius);
+
+    sums = (unsigned int *) malloc(3 * length * sizeof(unsigned int));
+
+    if (sums == NULL)
+      return 0;
+
+    if (method == BLUR_SUMMED_AREA)
+      box_blur_summed_area(buffer,radius,x0,y0,x1,y1,sums);
+    else
+      box_blur_running_sum(buffer,radius,x0,y0,x1,y1,sums);
+
+    free(sums);
+
+    return 1;
+  }
+
+//----------------------------------------------------------------------
+
+void supersampling(t_color_buffer *buffer, unsigned int level,
+  t_color_buffer *destination)
+
+  {
+    color_buffer_init(destination,buffer->width / level,
+      buffer->height / level);
+
+    for (unsigned int j = 0; j < destination->height; j++)
+      supersampling_kernel(buffer->data + 4 * (level * j) * buffer->width,
+        buffer->width,destination->data + 4 * j * destination->width,
+        destination->width,level);
   }
 
 //----------------------------------------------------------------------
@@ -13,6 +13,8 @@
 
 //**********************************************************************
 
+#include <stddef.h>
+
                            /** color buffer structure, it holds the
                                pointer to image in the memory */
 typedef struct
@@ -22,6 +24,14 @@ typedef struct
     unsigned char *data;   ///< raw pixel data in RGB 24bit mode
   } t_color_buffer;
 
+                           /** how color_buffer_box_blur() sums the
+                               pixels of the window */
+typedef enum
+  {
+    BLUR_RUNNING_SUM,      ///< separable, running sums along the rows and then the columns
+    BLUR_SUMMED_AREA       ///< lookups in a summed-area table of the blurred part
+  } t_blur_method;
+
 //----------------------------------------------------------------------
 
 unsigned char round_to_char(int value);
@@ -168,6 +178,40 @@ int color_buffer_save_to_png(t_color_buffer *buffer, char *filename);
 
 //----------------------------------------------------------------------
 
+int color_buffer_encode_png(t_color_buffer *buffer, unsigned char **png,
+  size_t *size);
+
+  /**<
+   * Encodes the buffer content to png in memory, so that encoding and
+   * writing the file can be done separately (color_buffer_save_to_png
+   * does both).
+   *
+   * @param buffer buffer to be encoded
+   * @param png in this variable a pointer to the png file data will be
+   *        returned, it has to be freed with free()
+   * @param size in this variable the size of the data will be returned
+   *
+   * @return 1 if evreything was ok, or 0 if the buffer could not be
+   *         encoded
+   */
+
+//----------------------------------------------------------------------
+
+int color_buffer_write_png(unsigned char *png, size_t size, char *filename);
+
+  /**<
+   * Writes png file data made by color_buffer_encode_png to file of given
+   * name.
+   *
+   * @param png png file data
+   * @param size size of the data
+   * @param filename name of the file
+   *
+   * @return 1 if evreything was ok, or 0 if file could not be saved
+   */
+
+//----------------------------------------------------------------------
+
 void color_buffer_clear(t_color_buffer *buffer);
 
   /**<
@@ -192,6 +236,55 @@ int color_buffer_load_from_png(t_color_buffer *buffer, char *filename);
 
 //----------------------------------------------------------------------
 
+void color_buffer_add_inverted(t_color_buffer *buffer,
+  t_color_buffer *mask, double intensity, unsigned int from_row,
+  unsigned int to_row, unsigned int from_column, unsigned int to_column);
+
+  /**<
+   * Adds (255 - red component of the mask pixel) * intensity, rounded
+   * down, to all the color components of the buffer pixels in given
+   * rows and columns, with saturation, like color_buffer_add_pixel()
+   * would. The rows are processed by the SIMD kernel selected by
+   * dispatch_init().
+   *
+   * @param buffer buffer to add to
+   * @param mask buffer of the same resolution whose red component is
+   *        added inverted
+   * @param intensity scale of the added values in range <0,1>
+   * @param from_row first row to process
+   * @param to_row row after the last one to process
+   * @param from_column first column to process
+   * @param to_column column after the last one to process
+   */
+
+//----------------------------------------------------------------------
+
+int color_buffer_box_blur(t_color_buffer *buffer, unsigned int radius,
+  unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1,
+  t_blur_method method);
+
+  /**<
+   * Box blurs a rectangle of the buffer, each of its pixels becomes the
+   * average, rounded down, of the (2 * radius + 1)^2 original pixels
+   * around it. The pixels out of the buffer are taken as the nearest
+   * ones on its edge. Both methods take the same time per pixel with any
+   * radius and give the same results, the rows are processed in
+   * parallel, so the function shouldn't be called in an OpenMP parallel
+   * region.
+   *
+   * @param buffer buffer to blur
+   * @param radius radius of the window, 0 leaves the buffer as it is
+   * @param x0 x coordinate of the top left pixel of the rectangle
+   * @param y0 y coordinate of the top left pixel of the rectangle
+   * @param x1 x coordinate after the bottom right pixel of the rectangle
+   * @param y1 y coordinate after the bottom right pixel of the rectangle
+   * @param method how the windows are summed
+   *
+   * @return 1 if everything was ok, or 0 if memory could not be
+   *         allocated
+   */
+//----------------------------------------------------------------------
+
 void supersampling(t_color_buffer *buffer, unsigned int level,
   t_color_buffer *destination);
 
@@ -205,6 +298,9 @@ void supersampling(t_color_buffer *buffer, unsigned int level,
    *        example number 2 will make the image 2x smaller)
    * @param destination color buffer in which the result will be stored,
    *        must be deallocated before this function is called
+   *
+   * The rows are averaged by the SIMD kernel selected by
+   * dispatch_init().
    */
 
 //----------------------------------------------------------------------
@@ -0,0 +1,84 @@
+#include "dispatch.h"
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define DISPATCH_X86
+#endif
+
+struct dispatch_entry
+  {
+    const char *kernel;
+    simd_level variant;
+  };
+
+static simd_level cpu_level = SIMD_GENERIC;
+static vector<dispatch_entry> entries;
+
+static simd_level detect_cpu_level()
+  {
+#ifdef DISPATCH_X86
+    __builtin_cpu_init();
+
+    // the AVX-512 kernels also use AVX2 for the remainders
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2"))
+      return SIMD_AVX512;
+
+    if (__builtin_cpu_supports("avx2"))
+      return SIMD_AVX2;
+
+    if (__builtin_cpu_supports("sse2"))
+      return SIMD_SSE2;
+#endif
+
+    return SIMD_GENERIC;
+  }
+
+void dispatch_init(simd_level max_level)
+  {
+    simd_level level;
+
+    cpu_level = detect_cpu_level();
+    level = cpu_level < max_level ? cpu_level : max_level;
+
+    entries.clear();
+
+    perlin_dispatch(level);
+    raytracing_dispatch(level);
+    color_buffer_dispatch(level);
+  }
+
+simd_level dispatch_cpu_level()
+  {
+    return cpu_level;
+  }
+
+const char *simd_level_name(simd_level level)
+  {
+    switch (level)
+      {
+        case SIMD_SSE2: return "sse2";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "generic";
+      }
+  }
+
+void dispatch_record(const char *kernel, simd_level variant)
+  {
+    dispatch_entry entry;
+
+    entry.kernel = kernel;
+    entry.variant = variant;
+    entries.push_back(entry);
+  }
+
+void dispatch_print()
+  {
+    cout << "cpu: " << simd_level_name(cpu_level) << endl;
+
+    for (unsigned int i = 0; i < entries.size(); i++)
+      cout << "  " << entries[i].kernel << ": " << simd_level_name(entries[i].variant) << endl;
+  }
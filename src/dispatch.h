@@ -0,0 +1,55 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/**<
+ Runtime selection of the SIMD kernels. skygen is built for the generic
+ CPU of the target (no -march), the kernels for the newer instruction
+ sets are compiled with target attributes and dispatch_init() picks the
+ best ones the CPU has, once at startup. All the levels give the same
+ results, which needs the build without floating point contraction
+ (-ffp-contract=off), the AVX-512 target includes FMA and the fused
+ multiply-adds would round differently. skygen --benchmark checks it.
+ */
+
+enum simd_level       /**< instruction sets, each one includes the previous ones */
+  {
+    SIMD_GENERIC,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+  };
+
+void dispatch_init(simd_level max_level = SIMD_AVX512);
+  /**<
+    Detects the CPU features and selects the kernels of all the modules.
+    Until it is called the generic kernels are used.
+
+    @param max_level the kernels above this level are not used even if
+           the CPU has them
+    */
+
+simd_level dispatch_cpu_level();
+  /**<
+    Gets the best instruction set of the CPU, dispatch_init() must have
+    been called.
+    */
+
+const char *simd_level_name(simd_level level);
+
+void dispatch_print();
+  /**<
+    Prints the CPU level and the variant selected for each kernel.
+    */
+
+void dispatch_record(const char *kernel, simd_level variant);
+  /**<
+    Used by the modules to report their selection for dispatch_print().
+    */
+
+// kernel selection of the modules, called by dispatch_init()
+
+void perlin_dispatch(simd_level level);
+void raytracing_dispatch(simd_level level);
+void color_buffer_dispatch(simd_level level);
+
+#endif
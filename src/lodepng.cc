@@ -2012,6 +2012,69 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
+unsigned lodepng_deflate_chunk(unsigned char** out, size_t* outsize,
+                               const unsigned char* in, size_t start, size_t end, int final,
+                               const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, pos, blocksize, numdeflateblocks;
+  size_t bp = 0; /*the bit pointer*/
+  unsigned windowsize = settings->windowsize;
+  int usezeros = windowsize >= 8192; /*like in encodeLZ77*/
+  Hash hash;
+  ucvector v;
+
+  if(settings->btype != 1 && settings->btype != 2) return 61;
+
+  if(settings->btype == 1) blocksize = end - start;
+  else /*if(settings->btype == 2)*/
+  {
+    blocksize = (end - start) / 8 + 8;
+    if(blocksize < 65535) blocksize = 65535;
+  }
+
+  numdeflateblocks = (end - start + blocksize - 1) / blocksize;
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+
+  error = hash_init(&hash, windowsize);
+  if(error) return error;
+
+  ucvector_init_buffer(&v, *out, *outsize);
+
+  /*prime the window with the bytes before the chunk, as if they had just been encoded*/
+  for(pos = start > windowsize ? start - windowsize : 0; pos < start; pos++)
+  {
+    unsigned hashval = getHash(in, end, pos);
+    updateHashChain(&hash, pos, hashval, windowsize);
+    if(usezeros && hashval == 0) hash.zeros[pos % windowsize] = countZeros(in, end, pos);
+  }
+
+  for(i = 0; i < numdeflateblocks && !error; i++)
+  {
+    int lastblock = final && i == numdeflateblocks - 1;
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    if(blockend > end) blockend = end;
+
+    if(settings->btype == 1) error = deflateFixed(&v, &bp, &hash, in, blockstart, blockend, settings, lastblock);
+    else error = deflateDynamic(&v, &bp, &hash, in, blockstart, blockend, settings, lastblock);
+  }
+
+  if(!error && !final)
+  {
+    /*sync flush: an empty stored block, BFINAL 0 and BTYPE 00, padded to the byte boundary*/
+    addBitsToStream(&bp, &v, 0, 3);
+    if(!ucvector_push_back(&v, 0) || !ucvector_push_back(&v, 0) ||
+       !ucvector_push_back(&v, 255) || !ucvector_push_back(&v, 255)) error = 83; /*alloc fail*/
+  }
+
+  hash_cleanup(&hash);
+
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 static unsigned deflate(unsigned char** out, size_t* outsize,
                         const unsigned char* in, size_t insize,
                         const LodePNGCompressSettings* settings)
@@ -2061,6 +2124,11 @@ static unsigned adler32(const unsigned char* data, unsigned len)
   return update_adler32(1L, data, len);
 }
 
+unsigned lodepng_adler32(const unsigned char* data, unsigned len)
+{
+  return adler32(data, len);
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -740,6 +740,21 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compress the part in[start..end) of a buffer with deflate, so that the parts of
+a buffer can be compressed separately (in parallel) and concatenated into one
+deflate stream. The LZ77 window starts filled with the bytes before start. Unless
+final is set, the last block isn't marked final and an empty stored block follows
+(a sync flush), so the output ends on a byte boundary. Only btype 1 and 2 are
+supported. Out buffer must be freed after use.
+*/
+unsigned lodepng_deflate_chunk(unsigned char** out, size_t* outsize,
+                               const unsigned char* in, size_t start, size_t end, int final,
+                               const LodePNGCompressSettings* settings);
+
+/*Return the adler32 checksum (used by zlib) of the bytes data[0..len-1].*/
+unsigned lodepng_adler32(const unsigned char* data, unsigned len);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
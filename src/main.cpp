@@ -4,17 +4,22 @@
 #include <stdlib.h>
 #include <string>
 #include <sstream>
+#include <algorithm>
+#include <omp.h>
+#include <map>
+#include <atomic>
+#include <chrono>
 #include "raytracing.h"
 #include "skyrenderer.h"
 #include "perlin.h"
 #include "colorbuffer.h"
+#include "dispatch.h"
+#include "benchmark.h"
+#include "pipeline.h"
 #include "getopt.h"
 
 using namespace std;
 
-// macro for int -> str conversion
-#define SSTR( x ) dynamic_cast< std::ostringstream & >( ( std::ostringstream() << std::dec << x ) ).str()
-
 struct param_struct       // command line argument values
   {
     double time;
@@ -28,13 +33,40 @@ struct param_struct       // command line argument values
     unsigned int supersampling;
     double clouds;        // how many clouds there are in range <0,1>
     double cloud_density;
+    bool seeded;          // whether the seeded table noise is used instead of the legacy one
+    unsigned int seed;
+    bool octave_lod;      // whether the far clouds leave out the aliasing octaves
+    bool ray_planes;      // reference mode, the sky planes are ray traced
+    bool stencil_glow;    // reference mode, the sun/moon glow is a blurred stencil
+    string geometry;      // file with the sky plane geometry, empty for the default planes
+    render_precision precision;
+    perlin_noise_type noise_type;
+    perlin_octave_preset octaves;
+    bool benchmark;       // measure the speed instead of generating the pictures
+    bool print_dispatch;
+    simd_level max_simd;  // the best instruction set the kernels may use
+    unsigned int frames_in_flight;  // how many frames of the animation are rendered at once
+    unsigned int max_memory;        // MB the frames on their way to the files may take, 0 for no limit
+    unsigned int encoders;          // threads encoding the PNGs
   } params;
 
+struct frame_slot         // a frame on its way through the render, encode and write stages
+  {
+    unsigned int frame;
+    t_color_buffer buffer;
+    render_statistics statistics;
+    unsigned char *png;
+    size_t png_size;
+    bool encoded;
+    double render_time;   // seconds
+    double encode_time;
+  };
+
 void print_help()
   {
      cout << "Skygen generates sky animations." << endl << endl;
      cout << "usage:" << endl << endl;
-     cout << "skygen [[-t time][-d duration][-f frames][-o name][-c amount][-e density][-x width][-y height][-p level][-s] | [-h]]" << endl << endl;
+     cout << "skygen [[-t time][-d duration][-f frames][-o name][-c amount][-e density][-x width][-y height][-p level][-r seed][-n type][-q octaves][-g file][-l][-s][--max-simd level][--precision type][--ray-planes][--stencil-glow][--frames-in-flight count][--encoders count][--max-memory MB] | [--benchmark] | [--print-dispatch] | [-h]]" << endl << endl;
      cout << "  -t specifies the day time, time is in HH:MM 24 hour format, for example 0:15, 12:00, 23:45. Default value is 12:00." << endl << endl;
      cout << "  -d specifies duration in minutes from the specified day time. If for example -t 12:00 -d 60 is set, the animation will be genrated from 12:00 to 13:00. If this flag is omitted, the whole animation will be generated at the same time of the day and will loop smoothly." << endl << endl;
      cout << "  -f specifies the number of frames of the animation. Default value is 1." << endl;
@@ -44,7 +76,21 @@ void print_help()
      cout << "  -p sets the supersampling level." << endl << endl;
      cout << "  -c say how many clouds there should be. amount is a whole number in range <0,100>." << endl << endl;
      cout << "  -e sets the cloud density. density is a whole number in range <0,100>." << endl << endl;
+     cout << "  -r sets the noise seed, seed is a whole number. Each seed gives different clouds. If this flag is omitted, the original noise is used and the clouds are the same as in the previous versions." << endl << endl;
+     cout << "  -n sets the noise type of the clouds, type is value (default) or simplex." << endl << endl;
+     cout << "  -q sets the noise octaves, octaves is fast (less detail), default or high (more detail)." << endl << endl;
+     cout << "  -g loads the geometry of the sky planes from file instead of the default flat planes. It is a Wavefront OBJ file with the v, vt, f statements and g lower or g upper before the faces of each plane, in the camera coordinates (x to the right, y forward, z down). The clouds are textured by the vt coordinates, each pixel shows the closest triangle of each plane." << endl << endl;
+     cout << "  -l turns on the octave level of detail, the far clouds leave out the finest noise octaves that would only alias. This is faster and shimmers less in animations, but the clouds differ slightly from the default ones." << endl << endl;
      cout << "  -s sets the silent mode, nothing will be written during rendering." << endl << endl;
+     cout << "  --benchmark measures the noise speed, the primary ray speed (also with more and more sky plane triangles), the box blur speed, the frame time of both noise types, how much the float precision differs from the double one, whether each SIMD level the CPU has gives the same results as the generic kernels and the ray packets the same hits as the scalar test and the frame time with 1 to 64 and all the threads with the other flags (-f sets the number of frames) and doesn't save any pictures. It fails if the SIMD level or the number of threads changes the picture." << endl << endl;
+     cout << "  --print-dispatch prints which SIMD variant of each kernel is used on this CPU." << endl << endl;
+     cout << "  --max-simd sets the best instruction set the kernels may use, generic, sse2, avx2 or avx512 (default, the best one the CPU has is used)." << endl << endl;
+     cout << "  --precision sets the scalar type of the per pixel computations, double (default) or float. The float pictures differ from the double ones by at most one color level, --benchmark reports how much." << endl << endl;
+     cout << "  --ray-planes renders the sky planes by intersecting each pixel ray with their triangles instead of mapping the pixels to them analytically. This is the slower reference to compare with, the pictures may differ by rounding." << endl << endl;
+     cout << "  --stencil-glow makes the glow around the sun/moon by blurring its stencil instead of computing how much of the window around each pixel it covers. This is the slower reference to compare with, the glow differs slightly." << endl << endl;
+     cout << "  --frames-in-flight sets how many frames of the animation are rendered at once, each by its share of the threads (default 1, all the threads render each frame). More frames at once keep more cores busy with small pictures, the files are still written in order." << endl << endl;
+     cout << "  --encoders sets how many threads encode the PNGs of the rendered frames (default 1), while the next frames render and the previous ones are written. Each encoder and each frame rendered at once get an equal share of the threads. A single picture is rendered and encoded with all the threads." << endl << endl;
+     cout << "  --max-memory limits the memory the frames on their way to the files may take, in MB, fewer frames are kept if they wouldn't fit. 0 (default) means no limit." << endl << endl;
      cout << "  -h prints help." << endl;
   }
 
@@ -62,6 +108,21 @@ void parse_command_line_arguments(int argc, char **argv)
     params.height = 768;
     params.silent = false;
     params.supersampling = 1;
+    params.seeded = false;
+    params.seed = 0;
+    params.octave_lod = false;
+    params.ray_planes = false;
+    params.stencil_glow = false;
+    params.geometry = "";
+    params.precision = PRECISION_DOUBLE;
+    params.noise_type = PERLIN_NOISE_VALUE;
+    params.octaves = PERLIN_OCTAVES_DEFAULT;
+    params.benchmark = false;
+    params.print_dispatch = false;
+    params.max_simd = SIMD_AVX512;
+    params.frames_in_flight = 1;
+    params.max_memory = 0;
+    params.encoders = 1;
 
     int i = 0;
     string helper_string;
@@ -100,6 +161,8 @@ void parse_command_line_arguments(int argc, char **argv)
               params.supersampling = saturate_int(atoi(argv[i + 1]),1,5);
             else if (helper_string == "-o")
               params.name = argv[i + 1];
+            else if (helper_string == "-g")
+              params.geometry = argv[i + 1];
             else if (helper_string == "-x")
               params.width = saturate_int(atoi(argv[i + 1]),0,65536);
             else if (helper_string == "-c")
@@ -108,6 +171,35 @@ void parse_command_line_arguments(int argc, char **argv)
               params.cloud_density = saturate_int(atoi(argv[i + 1]),0,100) / 100.0;
             else if (helper_string == "-y")
               params.height = saturate_int(atoi(argv[i + 1]),0,65536);
+            else if (helper_string == "-n")
+              params.noise_type = string(argv[i + 1]) == "simplex" ? PERLIN_NOISE_SIMPLEX : PERLIN_NOISE_VALUE;
+            else if (helper_string == "-q")
+              {
+                string octaves = argv[i + 1];
+
+                params.octaves = octaves == "fast" ? PERLIN_OCTAVES_FAST : octaves == "high" ? PERLIN_OCTAVES_HIGH :
+                  PERLIN_OCTAVES_DEFAULT;
+              }
+            else if (helper_string == "--max-simd")
+              {
+                string level = argv[i + 1];
+
+                params.max_simd = level == "generic" ? SIMD_GENERIC : level == "sse2" ? SIMD_SSE2 :
+                  level == "avx2" ? SIMD_AVX2 : SIMD_AVX512;
+              }
+            else if (helper_string == "--frames-in-flight")
+              params.frames_in_flight = saturate_int(atoi(argv[i + 1]),1,1024);
+            else if (helper_string == "--encoders")
+              params.encoders = saturate_int(atoi(argv[i + 1]),1,256);
+            else if (helper_string == "--max-memory")
+              params.max_memory = saturate_int(atoi(argv[i + 1]),0,1 << 24);
+            else if (helper_string == "--precision")
+              params.precision = string(argv[i + 1]) == "float" ? PRECISION_FLOAT : PRECISION_DOUBLE;
+            else if (helper_string == "-r")
+              {
+                params.seeded = true;
+                params.seed = strtoul(argv[i + 1],NULL,10);
+              }
             else
               i--;
 
@@ -116,19 +208,83 @@ void parse_command_line_arguments(int argc, char **argv)
 
         if (helper_string == "-s")
           params.silent = true;
+        else if (helper_string == "-l")
+          params.octave_lod = true;
         else if (helper_string == "-h")
           params.help = true;
+        else if (helper_string == "--benchmark")
+          params.benchmark = true;
+        else if (helper_string == "--print-dispatch")
+          params.print_dispatch = true;
+        else if (helper_string == "--ray-planes")
+          params.ray_planes = true;
+        else if (helper_string == "--stencil-glow")
+          params.stencil_glow = true;
 
         i++;
       }
   }
 
+void render_frame(sky_renderer *renderer, frame_slot *slot, double time_of_day, double offset)
+  {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    renderer->render_sky(&slot->buffer,time_of_day,params.clouds,params.cloud_density,offset);
+
+    slot->render_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    slot->statistics = renderer->get_statistics();
+  }
+
+void encode_frame(frame_slot *slot)
+  {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    if (params.supersampling > 1)
+      {
+        t_color_buffer helper_buffer;
+        supersampling(&slot->buffer,params.supersampling,&helper_buffer);
+        slot->encoded = color_buffer_encode_png(&helper_buffer,&slot->png,&slot->png_size);
+        color_buffer_destroy(&helper_buffer);
+      }
+    else
+      slot->encoded = color_buffer_encode_png(&slot->buffer,&slot->png,&slot->png_size);
+
+    slot->encode_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+bool write_frame(frame_slot *slot)
+  {
+    bool success = true;
+    string filename = params.frames == 1 ? params.name + ".png" : params.name + to_string(slot->frame + 1) + ".png";
+
+    if (!slot->encoded || !color_buffer_write_png(slot->png,slot->png_size,(char *) filename.c_str()))
+      {
+        cout << "could not save " << filename << endl;
+        success = false;
+      }
+
+    if (!params.silent)
+      {
+        render_statistics *statistics = &slot->statistics;
+
+        cout << "saved image " << (slot->frame + 1) << endl;
+        cout << "  render " << slot->render_time * 1e3 << " ms, encode " << slot->encode_time * 1e3 << " ms" << endl;
+        cout << "  cloudless tiles skipped: " << 100.0 * statistics->skipped_tiles[0] / statistics->tiles << " % (lower plane), "
+          << 100.0 * statistics->skipped_tiles[1] / statistics->tiles << " % (upper plane)" << endl;
+        cout << "  thread busy time: " << 1e3 * *min_element(statistics->busy_time.begin(),statistics->busy_time.end())
+          << " to " << 1e3 * *max_element(statistics->busy_time.begin(),statistics->busy_time.end()) << " ms, "
+          << statistics->stolen_tiles << " tile steals" << endl;
+      }
+
+    free(slot->png);
+
+    return success;
+  }
+
 int main(int argc, char **argv)
   {
     unsigned int i;
-    t_color_buffer buffer;
     double step, noise_offset, noise_step;
-    string filename;
     sky_renderer renderer;
 
     parse_command_line_arguments(argc,argv);
@@ -139,7 +295,69 @@ int main(int argc, char **argv)
         return 0;
       }
 
-    color_buffer_init(&buffer,params.width * params.supersampling,params.height * params.supersampling);
+    dispatch_init(params.max_simd);
+
+    if (params.print_dispatch)
+      {
+        dispatch_print();
+        return 0;
+      }
+
+    if (params.seeded)
+      perlin_init(params.seed);
+
+    renderer.set_octave_lod(params.octave_lod);
+    renderer.set_ray_traced_planes(params.ray_planes);
+    renderer.set_stencil_glow(params.stencil_glow);
+    renderer.set_precision(params.precision);
+
+    if (params.geometry != "")
+      {
+        unsigned int error_line;
+
+        if (!renderer.load_geometry(params.geometry.c_str(),&error_line))
+          {
+            if (error_line == 0)
+              cout << "could not read the geometry file " << params.geometry << endl;
+            else
+              cout << params.geometry << ":" << error_line << ": wrong geometry statement" << endl;
+
+            return 1;
+          }
+      }
+
+    perlin_set_noise_type(params.noise_type);
+    perlin_set_octave_preset(params.octaves);
+
+    if (params.benchmark)
+      {
+        benchmark_noise(1 << 20);
+        benchmark_rays(&renderer,params.width * params.supersampling,params.height * params.supersampling);
+        benchmark_geometry(&renderer,params.width * params.supersampling,params.height * params.supersampling,5);
+        benchmark_blur(params.width * params.supersampling,params.height * params.supersampling);
+        benchmark_frames(&renderer,params.width * params.supersampling,params.height * params.supersampling,
+          params.time,params.clouds,params.cloud_density,params.frames);
+        benchmark_precision(&renderer,params.width * params.supersampling,params.height * params.supersampling,
+          params.time,params.clouds,params.cloud_density,params.frames);
+
+        if (!benchmark_packets(&renderer,params.width * params.supersampling,params.height * params.supersampling,
+          params.max_simd))
+          return 1;
+
+        if (!benchmark_simd(&renderer,params.width * params.supersampling,params.height * params.supersampling,
+          params.time,params.clouds,params.cloud_density,params.max_simd))
+          return 1;
+
+        if (!benchmark_threads(&renderer,params.width * params.supersampling,params.height * params.supersampling,
+          params.time,params.clouds,params.cloud_density))
+          return 1;
+
+        return 0;
+      }
+
+    unsigned int width = params.width * params.supersampling;
+    unsigned int height = params.height * params.supersampling;
+    vector<double> times(params.frames), noise_offsets(params.frames);
 
     step = params.duration / params.frames;        // step in time
     noise_offset = 0;                              // noise offset for animating the noise, only used with static daytime
@@ -147,32 +365,177 @@ int main(int argc, char **argv)
 
     for (i = 0; i < params.frames; i++)
       {
+        times[i] = params.time + i * step;
+        noise_offsets[i] = noise_offset;
+
+        if (params.duration == 0.0)        // hopefully this is safe
+          noise_offset += noise_step;
+      }
+
+    unsigned int thread_limit = omp_get_thread_limit();
+
+    if (params.frames == 1 || thread_limit < 3)   // nothing to overlap or no threads for the stages, all the threads render and then encode each picture
+      {
+        frame_slot slot;
+        bool success = true;
+
+        color_buffer_init(&slot.buffer,width,height);
+
+        for (i = 0; i < params.frames; i++)
+          {
+            slot.frame = i;
+            render_frame(&renderer,&slot,times[i],noise_offsets[i]);
+            encode_frame(&slot);
+
+            if (!write_frame(&slot))
+              success = false;
+          }
+
+        color_buffer_destroy(&slot.buffer);
+
         if (!params.silent)
+          cout << "done" << endl;
+
+        return success ? 0 : 1;
+      }
+
+    /* The frames go through a pipeline of three stages connected by
+       bounded queues: up to frames_in_flight render threads, each with its
+       own copy of the renderer (it keeps per resolution caches) and its
+       share of the threads for the tiles, the encoder threads that make
+       the PNGs, also with their shares for the deflate chunks, and one
+       writer that saves them in order. Each frame takes one of a fixed
+       number of slots (a picture buffer) from the render to the write, so
+       while the slots are all taken the render threads wait, which bounds
+       the memory. */
+
+    size_t picture_bytes = 4 * (size_t) width * height;
+    size_t output_bytes = picture_bytes / (params.supersampling * params.supersampling);
+    size_t slot_bytes = picture_bytes + 3 * output_bytes +                  // the PNG and what encoding it takes, about
+      (params.supersampling > 1 ? output_bytes : 0);
+    size_t renderer_bytes = renderer.frame_memory(width,height);
+
+    unsigned int renderer_count = min(params.frames_in_flight,params.frames);
+    unsigned int encoder_count = params.encoders;
+
+    while (renderer_count + encoder_count + 1 > thread_limit)               // all the stage threads have to exist at once
+      if (encoder_count >= renderer_count)
+        encoder_count--;
+      else
+        renderer_count--;
+
+    unsigned int slot_count = renderer_count + encoder_count + 1;           // enough for all the stages to work at once
+
+    if (params.max_memory != 0)
+      while (slot_count > 1 && renderer_count * renderer_bytes + slot_count * slot_bytes > (((size_t) params.max_memory) << 20))
+        {
+          slot_count--;
+          renderer_count = min(renderer_count,slot_count);
+        }
+
+    // the writer mostly waits for the disk, the render and encoder threads split the cores, the render ones get the rest
+    int threads = min(omp_get_max_threads(),(int) thread_limit);
+    unsigned int threads_per_encoder = max(1,threads / (int) (renderer_count + encoder_count));
+    unsigned int threads_per_frame = max(1,(threads - (int) (encoder_count * threads_per_encoder)) / (int) renderer_count);
+
+    if (!params.silent)
+      cout << renderer_count << " frames rendered at once with " << threads_per_frame << " threads each, " << encoder_count
+        << " encoders with " << threads_per_encoder << " threads each, " << slot_count << " frames in the pipeline, about "
+        << ((renderer_count * renderer_bytes + slot_count * slot_bytes) >> 20) << " MB" << endl;
+
+    vector<sky_renderer> renderers(renderer_count,renderer);
+    vector<frame_slot> slots(slot_count);
+    bounded_queue<frame_slot *> free_slots(slot_count), to_encode(slot_count), to_write(slot_count);
+    atomic<unsigned int> next_frame(0), working_renderers(renderer_count), working_encoders(encoder_count);
+    bool success = true;
+
+    for (i = 0; i < slot_count; i++)
+      {
+        color_buffer_init(&slots[i].buffer,width,height);
+        free_slots.push(&slots[i]);
+      }
+
+    omp_set_dynamic(0);                    // each stage needs its threads
+    omp_set_max_active_levels(2);          // the stages, the tiles of each frame
+
+    #pragma omp parallel num_threads(renderer_count + encoder_count + 1)
+    {
+    unsigned int thread = omp_get_thread_num();
+    frame_slot *slot;
+
+    if (thread < renderer_count)           // render
+      {
+        omp_set_num_threads(threads_per_frame);
+
+        while (free_slots.pop(slot))
           {
-            cout << "rendering image " << (i + 1) << endl;
+            slot->frame = next_frame++;
+
+            if (slot->frame >= params.frames)
+              {
+                free_slots.push(slot);             // for the other render threads to find out too
+                break;
+              }
+
+            render_frame(&renderers[thread],slot,times[slot->frame],noise_offsets[slot->frame]);
+            to_encode.push(slot);
           }
 
-        renderer.render_sky(&buffer,params.time + i * step,params.clouds,params.cloud_density,noise_offset);
+        if (--working_renderers == 0)
+          to_encode.close();
+      }
+    else if (thread < renderer_count + encoder_count)     // encode
+      {
+        omp_set_num_threads(threads_per_encoder);          // the PNG chunks are deflated in parallel too
 
-        if (params.duration == 0.0)        // hopefully this is safe
-          noise_offset += noise_step;
+        while (to_encode.pop(slot))
+          {
+            encode_frame(slot);
+            to_write.push(slot);
+          }
 
-        filename = params.frames == 1 ? params.name + ".png" : params.name + SSTR(i + 1) + ".png";
-        color_buffer_save_to_png(&buffer,(char *) filename.c_str());
+        if (--working_encoders == 0)
+          to_write.close();
+      }
+    else                                   // write, in order
+      {
+        map<unsigned int, frame_slot *> waiting;           // encoded frames whose previous ones aren't written yet
+        unsigned int frame = 0;
 
-        if (params.supersampling > 1)
+        while (to_write.pop(slot))
           {
-            t_color_buffer helper_buffer;
-            supersampling(&buffer,params.supersampling,&helper_buffer);
-            color_buffer_save_to_png(&helper_buffer,(char *) filename.c_str());
-            color_buffer_destroy(&helper_buffer);
+            waiting[slot->frame] = slot;
+
+            while (!waiting.empty() && waiting.begin()->first == frame)
+              {
+                slot = waiting.begin()->second;
+                waiting.erase(waiting.begin());
+
+                if (!write_frame(slot))
+                  success = false;
+
+                frame++;
+                free_slots.push(slot);
+              }
           }
       }
+    } // omp parallel end
 
-    if (!params.silent)
-      cout << "done" << endl;
+    if (!params.silent)   // where the stages waited, see bounded_queue
+      {
+        queue_statistics statistics[3] = {free_slots.get_statistics(), to_encode.get_statistics(), to_write.get_statistics()};
+
+        cout << "pipeline:" << endl;
+        cout << "  render waited " << statistics[0].pop_stall << " s for a free frame" << endl;
+        cout << "  encoders waited " << statistics[1].pop_stall << " s for a rendered frame, queue at most " << statistics[1].max_depth
+          << " (mean " << statistics[1].mean_depth << ")" << endl;
+        cout << "  writer waited " << statistics[2].pop_stall << " s for an encoded frame, queue at most " << statistics[2].max_depth
+          << " (mean " << statistics[2].mean_depth << ")" << endl;
+        cout << "done" << endl;
+      }
 
-    color_buffer_destroy(&buffer);
+    for (i = 0; i < slot_count; i++)
+      color_buffer_destroy(&slots[i].buffer);
 
-    return 0;
+    return success ? 0 : 1;
   }
@@ -3,18 +3,112 @@
  */
 
 #include "perlin.h"
+#include "dispatch.h"
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define PERLIN_X86
+  #include <immintrin.h>
+#endif
 
 /**
  * nejaky "nahodny" sum
  * v intervalu (-1, 1)
  */
-static inline float noise(int x, int y, int z)
+static inline int hash_legacy(int x, int y, int z)
 {
     int n;
     n = x + y * 57 + z * 23;
     n = (n<<13) ^ n;
-    return ( 1.0 - ((n * (n * n * 15731 + 789221) + 1376312589) & 0x7fffffff) / 1073741824.0);
+    return (n * (n * n * 15731 + 789221) + 1376312589) & 0x7fffffff;
+}
+
+static inline float noise_legacy(int x, int y, int z)
+{
+    return ( 1.0 - hash_legacy(x, y, z) / 1073741824.0);
+}
+
+/*
+ * Permutation table backend, the table is duplicated so that an index
+ * plus a permuted value never needs wrapping. Coordinates are hashed byte
+ * by byte, lattice coordinates go up to PERLIN_WIDTH, so two bytes each.
+ */
+static bool use_table = false;
+static bool use_simplex = false;   // simplex instead of value noise, see simplex_octave()
+static unsigned char permutation[512];
+static float lattice_values[256];
+
+static inline int hash_table(int x, int y, int z)
+{
+    int h;
+    h = permutation[x & 255];
+    h = permutation[h + ((x >> 8) & 255)];
+    h = permutation[h + (y & 255)];
+    h = permutation[h + ((y >> 8) & 255)];
+    h = permutation[h + (z & 255)];
+    return permutation[h + ((z >> 8) & 255)];
+}
+
+static inline float noise_table(int x, int y, int z)
+{
+    return lattice_values[hash_table(x, y, z)];
+}
+
+static inline float noise(int x, int y, int z)
+{
+    return use_table ? noise_table(x, y, z) : noise_legacy(x, y, z);
+}
+
+/*
+ * xorshift generator for the tables, rand() is not used so that the
+ * noise does not depend on (or disturb) other users of it
+ */
+static unsigned int next_random(unsigned int &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+void perlin_init(unsigned int seed)
+{
+    unsigned int state = seed * 2654435761u + 1;  // xorshift must not start at 0
+
+    for (int i = 0; i < 256; i++) {
+        permutation[i] = i;
+        // values spread over (-1, 1) like the legacy hash
+        lattice_values[i] = (next_random(state) >> 8) / 8388608.0f - 1.0f;
+    }
+
+    for (int i = 255; i > 0; i--) {  // Fisher-Yates shuffle
+        int j = next_random(state) % (i + 1);
+        unsigned char helper = permutation[i];
+        permutation[i] = permutation[j];
+        permutation[j] = helper;
+    }
+
+    for (int i = 0; i < 256; i++)
+        permutation[256 + i] = permutation[i];
+
+    use_table = true;
+}
+
+void perlin_init_legacy()
+{
+    use_table = false;
+}
+
+void perlin_set_noise_type(perlin_noise_type type)
+{
+    use_simplex = type == PERLIN_NOISE_SIMPLEX;
+}
+
+perlin_noise_type perlin_get_noise_type()
+{
+    return use_simplex ? PERLIN_NOISE_SIMPLEX : PERLIN_NOISE_VALUE;
 }
 
 
@@ -27,61 +121,1039 @@ static inline float interpolate(float a, float b, float t)
 }
 
 
-// kolikatou iteraci zacit - nizke frekvence moc nemaji smysl
-#define OCT_START 3
-// posledni iterace
-#define OCTAVES 10
+/*
+ * Octave configuration of the noise. It is a template parameter of the
+ * noise functions, so the octave loops have constant bounds and are fully
+ * unrolled (the pragmas before them), and in every unrolled octave the cell
+ * size, the shifts, masks and the amplitude are compile time constants.
+ */
+template <int START, int COUNT, int WIDTH_BITS>
+struct octave_config
+{
+    static const int start = START;             // kolikatou iteraci zacit - nizke frekvence moc nemaji smysl
+    static const int end = START + COUNT;       // prvni oktava, ktera uz se nepocita
+    static const int width_bits = WIDTH_BITS;   // velikost bunky v oktave o je 1 << (width_bits - o)
+    static const int width = 1 << WIDTH_BITS;   // period of the noise
+
+    static_assert(COUNT > 0 && COUNT <= PERLIN_MAX_OCTAVES, "bad number of octaves");
+    static_assert(START + COUNT - 1 <= WIDTH_BITS, "the cells of the finest octave must be at least 1 wide");
+
+    // amplitude of an octave, the first one has 1
+    static constexpr float amplitude(int octave)
+    {
+        return 1.0f / (1 << (octave - START));
+    }
+
+    // sum of the amplitudes of the octaves after the given one
+    static constexpr float remaining_amplitude(int octave)
+    {
+        return amplitude(octave) - amplitude(START + COUNT - 1);
+    }
+};
+
+// the presets of perlin_octave_preset, the renderer maps the sky planes to
+// <0,PERLIN_WIDTH>, so they all have that period
+typedef octave_config<3, 5, 10> octaves_fast;
+typedef octave_config<3, 7, 10> octaves_default;    // the original octaves 3 to 9
+typedef octave_config<3, 8, 10> octaves_high;
+
+static_assert(octaves_fast::width == PERLIN_WIDTH && octaves_default::width == PERLIN_WIDTH &&
+    octaves_high::width == PERLIN_WIDTH, "the presets must match PERLIN_WIDTH");
+
+/*
+ * sum jedne oktavy na souradnicich <x, y, z>, v intervalu <-1, 1>
+ */
+template <class C>
+static inline __attribute__((always_inline)) float value_octave(float x, float y, float z, int octave)
+{
+    // a power of two, known at compile time in the unrolled octave loops
+    // (this is always inlined into them), so the divisions and modulos
+    // below compile to shifts and masks
+    int sample = C::width >> (octave);
+
+    // vypocet souradnic rohu kostky, ve kerych se bude pocitat sum
+    // a mezi nimi iterpolovat
+    int x_0 = ((int)x / sample) * sample;
+    int x_1 = (x_0 + sample) % C::width;
+    int y_0 = ((int)y / sample) * sample;
+    int y_1 = (y_0 + sample) % C::width;
+    int z_0 = ((int)z / sample) * sample;
+    int z_1 = (z_0 + sample) % C::width;
+
+    // koeficienty pro interpolaci
+    float x_t = (float) (x - x_0) / sample;
+    float y_t = (float) (y - y_0) / sample;
+    float z_t = (float) (z - z_0) / sample;
+
+    // sum v 8 rohovych bodech
+    float a_0 = noise(x_0, y_0, z_0);
+    float a_1 = noise(x_1, y_0, z_0);
+    float a_2 = noise(x_0, y_1, z_0);
+    float a_3 = noise(x_1, y_1, z_0);
+    float a_4 = noise(x_0, y_0, z_1);
+    float a_5 = noise(x_1, y_0, z_1);
+    float a_6 = noise(x_0, y_1, z_1);
+    float a_7 = noise(x_1, y_1, z_1);
+
+    // interpolace v ose x
+    float b_0 = interpolate(a_0, a_1, x_t);
+    float b_1 = interpolate(a_2, a_3, x_t);
+    float b_2 = interpolate(a_4, a_5, x_t);
+    float b_3 = interpolate(a_6, a_7, x_t);
+    // interpolace v ose y
+    float c_0 = interpolate(b_0, b_1, y_t);
+    float c_1 = interpolate(b_2, b_3, y_t);
+    // interpolace v ose z
+    return interpolate(c_0, c_1, z_t);
+}
+
+/*
+ * Simplex noise of one octave, in range <-1, 1> like value_octave(). The
+ * coordinates, divided by the octave cell size, are taken as coordinates
+ * of the skewed simplex lattice directly instead of skewing them, so the
+ * lattice is axis aligned and wrapping the corners keeps the noise
+ * periodic over PERLIN_WIDTH like the value noise (the sky planes wrap
+ * their texturing coordinates). The noise field is only slightly sheared
+ * by that. The gradients are chosen by the lattice hash of the backend.
+ */
+#define SIMPLEX_G3 (1.0f / 6.0f)   // unskewing factor of 3D simplex noise
+
+// the 12 cube edge directions, 4 of them twice so that a mask can pick one
+static const float simplex_gradients[16][3] = {
+    {1, 1, 0}, {-1, 1, 0}, {1, -1, 0}, {-1, -1, 0},
+    {1, 0, 1}, {-1, 0, 1}, {1, 0, -1}, {-1, 0, -1},
+    {0, 1, 1}, {0, -1, 1}, {0, 1, -1}, {0, -1, -1},
+    {1, 1, 0}, {-1, 1, 0}, {0, -1, 1}, {0, -1, -1}};
+
+// the backend is a template parameter, with a runtime condition the
+// compiler computes both hashes and selects one
+template <bool table>
+static inline int lattice_hash(int x, int y, int z)
+{
+    // the low bits of the legacy hash are poor
+    return table ? hash_table(x, y, z) : hash_legacy(x, y, z) >> 8;
+}
+
+// contribution of one simplex corner at offset <x, y, z> from the sample
+static inline float simplex_corner(int hash, float x, float y, float z)
+{
+    float t = 0.6f - x * x - y * y - z * z;
+    const float *g = simplex_gradients[hash & 15];
+
+    t = (t + fabsf(t)) * 0.5f;   // max(t, 0) without a branch, the sign of t is random
+    t *= t;
+
+    return t * t * (g[0] * x + g[1] * y + g[2] * z);
+}
+
+template <bool table, class C>
+static inline __attribute__((always_inline)) float simplex_octave_hashed(float x, float y, float z, int octave)
+{
+    int mask = (1 << octave) - 1;
+    float scale = (1 << octave) * (1.0f / C::width);   // powers of two, exact
+
+    float p_x = x * scale;
+    float p_y = y * scale;
+    float p_z = z * scale;
+
+    // coordinates are not negative, so truncation is floor
+    int i = (int) p_x;
+    int j = (int) p_y;
+    int k = (int) p_z;
+
+    // unskewed offset from the first simplex corner
+    float t = ((p_x - i) + (p_y - j) + (p_z - k)) * SIMPLEX_G3;
+    float x_0 = (p_x - i) - t;
+    float y_0 = (p_y - j) - t;
+    float z_0 = (p_z - k) - t;
+
+    // the simplex is given by the order of the offsets, the second corner
+    // steps along the largest one, the third one along the two largest
+    // (bitwise operators, branches would be mispredicted half of the time)
+    int i_1 = (x_0 >= y_0) & (x_0 >= z_0);
+    int j_1 = (y_0 > x_0) & (y_0 >= z_0);
+    int k_1 = (z_0 > x_0) & (z_0 > y_0);
+    int i_2 = (x_0 >= y_0) | (x_0 >= z_0);
+    int j_2 = (y_0 > x_0) | (y_0 >= z_0);
+    int k_2 = (z_0 > x_0) | (z_0 > y_0);
+
+    float sum = simplex_corner(lattice_hash<table>(i & mask, j & mask, k & mask), x_0, y_0, z_0);
+    sum += simplex_corner(lattice_hash<table>((i + i_1) & mask, (j + j_1) & mask, (k + k_1) & mask),
+        x_0 - i_1 + SIMPLEX_G3, y_0 - j_1 + SIMPLEX_G3, z_0 - k_1 + SIMPLEX_G3);
+    sum += simplex_corner(lattice_hash<table>((i + i_2) & mask, (j + j_2) & mask, (k + k_2) & mask),
+        x_0 - i_2 + 2 * SIMPLEX_G3, y_0 - j_2 + 2 * SIMPLEX_G3, z_0 - k_2 + 2 * SIMPLEX_G3);
+    sum += simplex_corner(lattice_hash<table>((i + 1) & mask, (j + 1) & mask, (k + 1) & mask),
+        x_0 - 1 + 3 * SIMPLEX_G3, y_0 - 1 + 3 * SIMPLEX_G3, z_0 - 1 + 3 * SIMPLEX_G3);
+
+    // 32 scales the sum to about <-1, 1>, the clamp guarantees it for the
+    // early termination bounds
+    sum *= 32.0f;
+
+    return sum < -1 ? -1 : (sum > 1 ? 1 : sum);
+}
+
+template <class C>
+static inline __attribute__((always_inline)) float simplex_octave(float x, float y, float z, int octave)
+{
+    return use_table ? simplex_octave_hashed<true, C>(x, y, z, octave) :
+        simplex_octave_hashed<false, C>(x, y, z, octave);
+}
+
+template <class C>
+static inline __attribute__((always_inline)) float octave_noise(float x, float y, float z, int octave)
+{
+    return use_simplex ? simplex_octave<C>(x, y, z, octave) : value_octave<C>(x, y, z, octave);
+}
 
 /*
  * perlinuv sum na souradnicich <x, y, z> z prostoru PERLIN_WIDTH^3
  */
-float perlin(float x, float y, float z)
+template <class C>
+static float octave_sum(float x, float y, float z)
 {
     float sum_noise = 0.0;
 
-    for(int octave = OCT_START; octave < OCTAVES; octave += 1) {
+    #pragma GCC unroll 16
+    for(int octave = C::start; octave < C::end; octave += 1) {
+        // suma sumu ruznych frekvenci
+        sum_noise += octave_noise<C>(x, y, z, octave) * C::amplitude(octave);
+    }
 
-        int sample = PERLIN_WIDTH >> (octave);
+    // sum je (-1, 1), my chceme (0, 1)
+    return (sum_noise + 1) / 2;
+}
+
+/*
+ * Early termination of the octave sum. An octave adds at most its
+ * amplitude in either direction (the interpolation can't leave the
+ * <-1, 1> range of the lattice noise), so after an octave the final sum
+ * lies within remaining_amplitude() of the partial one. BOUND_MARGIN
+ * covers the float rounding of the partial sums.
+ */
+#define BOUND_MARGIN 1e-4f
+
+template <class C>
+static float octave_sum_thresholded(float x, float y, float z, float threshold)
+{
+    float sum_noise = 0.0;
+
+    #pragma GCC unroll 16
+    for(int octave = C::start; octave < C::end; octave += 1) {
+        sum_noise += octave_noise<C>(x, y, z, octave) * C::amplitude(octave);
+
+        float upper = (sum_noise + C::remaining_amplitude(octave) + 1) / 2;
+        float lower = (sum_noise - C::remaining_amplitude(octave) + 1) / 2;
+
+        if (upper < threshold - BOUND_MARGIN)   // can't reach the threshold anymore
+            return upper;
+
+        if (lower > 1 + BOUND_MARGIN)           // will be saturated anyway
+            return lower;
+    }
+
+    return (sum_noise + 1) / 2;
+}
+
+perlin_row_sampler::perlin_row_sampler()
+{
+    this->reset();
+}
+
+void perlin_row_sampler::reset()
+{
+    for (int i = 0; i < PERLIN_MAX_OCTAVES; i++)
+        this->cell_x[i] = INT_MIN;  // no lattice cell starts here
+}
+
+// perlin_row_sampler::sample(), the cached corners are passed in
+template <class C>
+static float row_sample(int *cell_x, int *cell_y, int *cell_z, float (*corners)[8], float x, float y, float z)
+{
+    float sum_noise = 0.0;
+
+    #pragma GCC unroll 16
+    for(int octave = C::start; octave < C::end; octave += 1) {
+
+        int sample = C::width >> (octave);
+        float *a = corners[octave - C::start];
 
-        // vypocet souradnic rohu kostky, ve kerych se bude pocitat sum
-        // a mezi nimi iterpolovat
         int x_0 = ((int)x / sample) * sample;
-        int x_1 = (x_0 + sample) % PERLIN_WIDTH;
         int y_0 = ((int)y / sample) * sample;
-        int y_1 = (y_0 + sample) % PERLIN_WIDTH;
         int z_0 = ((int)z / sample) * sample;
-        int z_1 = (z_0 + sample) % PERLIN_WIDTH;
 
-        // koeficienty pro interpolaci
+        // the corners only change when the sample crosses a cell boundary
+        if (x_0 != cell_x[octave - C::start] || y_0 != cell_y[octave - C::start] ||
+            z_0 != cell_z[octave - C::start]) {
+            int x_1 = (x_0 + sample) % C::width;
+            int y_1 = (y_0 + sample) % C::width;
+            int z_1 = (z_0 + sample) % C::width;
+
+            a[0] = noise(x_0, y_0, z_0);
+            a[1] = noise(x_1, y_0, z_0);
+            a[2] = noise(x_0, y_1, z_0);
+            a[3] = noise(x_1, y_1, z_0);
+            a[4] = noise(x_0, y_0, z_1);
+            a[5] = noise(x_1, y_0, z_1);
+            a[6] = noise(x_0, y_1, z_1);
+            a[7] = noise(x_1, y_1, z_1);
+
+            cell_x[octave - C::start] = x_0;
+            cell_y[octave - C::start] = y_0;
+            cell_z[octave - C::start] = z_0;
+        }
+
         float x_t = (float) (x - x_0) / sample;
         float y_t = (float) (y - y_0) / sample;
         float z_t = (float) (z - z_0) / sample;
 
-        // sum v 8 rohovych bodech
-        float a_0 = noise(x_0, y_0, z_0);
-        float a_1 = noise(x_1, y_0, z_0);
-        float a_2 = noise(x_0, y_1, z_0);
-        float a_3 = noise(x_1, y_1, z_0);
-        float a_4 = noise(x_0, y_0, z_1);
-        float a_5 = noise(x_1, y_0, z_1);
-        float a_6 = noise(x_0, y_1, z_1);
-        float a_7 = noise(x_1, y_1, z_1);
-
-        // interpolace v ose x
-        float b_0 = interpolate(a_0, a_1, x_t);
-        float b_1 = interpolate(a_2, a_3, x_t);
-        float b_2 = interpolate(a_4, a_5, x_t);
-        float b_3 = interpolate(a_6, a_7, x_t);
-        // interpolace v ose y
+        float b_0 = interpolate(a[0], a[1], x_t);
+        float b_1 = interpolate(a[2], a[3], x_t);
+        float b_2 = interpolate(a[4], a[5], x_t);
+        float b_3 = interpolate(a[6], a[7], x_t);
         float c_0 = interpolate(b_0, b_1, y_t);
         float c_1 = interpolate(b_2, b_3, y_t);
-        // interpolace v ose z
         float d_0 = interpolate(c_0, c_1, z_t);
 
-        // suma sumu ruznych frekvenci
-        sum_noise += d_0 / (1 << (octave-OCT_START));
+        sum_noise += d_0 * C::amplitude(octave);
     }
 
-    // sum je (-1, 1), my chceme (0, 1)
     return (sum_noise + 1) / 2;
 }
+
+/*
+ * The lattice of an octave with cells of size sample has PERLIN_WIDTH /
+ * sample + 1 points in each direction, the last one is the point at
+ * PERLIN_WIDTH, which a sample lying exactly on the edge uses as its x_0.
+ * Its x_1 wraps like in perlin(), index (cells + 1) & (cells - 1) == 1.
+ */
+template <class C>
+static void slice_build(float z, std::vector<float> &lattice, size_t *offsets)
+{
+    size_t size = 0;
+
+    for (int octave = C::start; octave < C::end; octave += 1) {
+        int cells = 1 << octave;
+
+        offsets[octave - C::start] = size;
+        size += (cells + 1) * (cells + 1);
+    }
+
+    lattice.resize(size);
+
+    for (int octave = C::start; octave < C::end; octave += 1) {
+        int sample = C::width >> octave;
+        int cells = 1 << octave;
+        float *values = &lattice[offsets[octave - C::start]];
+
+        int z_0 = ((int)z / sample) * sample;
+        int z_1 = (z_0 + sample) % C::width;
+        float z_t = (float) (z - z_0) / sample;
+
+        #pragma omp parallel for
+        for (int j = 0; j <= cells; j++)
+            for (int i = 0; i <= cells; i++)
+                values[j * (cells + 1) + i] = interpolate(noise(i * sample, j * sample, z_0),
+                    noise(i * sample, j * sample, z_1), z_t);
+    }
+}
+
+/*
+ * low and high are the bounds for early termination, see
+ * perlin_thresholded(), lod is the octave level of detail, see
+ * perlin_slice::sample_batch_lod()
+ */
+static inline float octave_weight(float lod, int octave)
+{
+    float weight = lod - octave;   // not fminf()/fmaxf(), they are library calls
+
+    return weight < 0 ? 0 : (weight > 1 ? 1 : weight);
+}
+
+template <class C>
+static inline float slice_sample(const float *lattice, const size_t *offsets, float x, float y,
+    float low, float high, float lod)
+{
+    float sum_noise = 0.0;
+    int xi = (int)x;
+    int yi = (int)y;
+
+    #pragma GCC unroll 16
+    for(int octave = C::start; octave < C::end; octave += 1) {
+
+        if (lod <= octave)   // this and the finer octaves would alias
+            break;
+
+        int shift = C::width_bits - octave;
+        int cells = 1 << octave;
+        const float *values = lattice + offsets[octave - C::start];
+
+        // coordinates are not negative, so shifts can replace the divisions
+        int i_0 = xi >> shift;
+        int i_1 = (i_0 + 1) & (cells - 1);
+        int j_0 = yi >> shift;
+        int j_1 = (j_0 + 1) & (cells - 1);
+        const float *row_0 = values + j_0 * (cells + 1);
+        const float *row_1 = values + j_1 * (cells + 1);
+
+        float x_t = (x - (i_0 << shift)) * (1.0f / (1 << shift));
+        float y_t = (y - (j_0 << shift)) * (1.0f / (1 << shift));
+
+        float b_0 = interpolate(row_0[i_0], row_0[i_1], x_t);
+        float b_1 = interpolate(row_1[i_0], row_1[i_1], x_t);
+        float c_0 = interpolate(b_0, b_1, y_t) * octave_weight(lod, octave);
+
+        sum_noise += c_0 * C::amplitude(octave);
+
+        float upper = (sum_noise + C::remaining_amplitude(octave) + 1) / 2;
+        float lower = (sum_noise - C::remaining_amplitude(octave) + 1) / 2;
+
+        if (upper < low)
+            return upper;
+
+        if (lower > high)
+            return lower;
+    }
+
+    return (sum_noise + 1) / 2;
+}
+
+// simplex counterpart of slice_sample()
+template <class C>
+static float simplex_sample(float x, float y, float z, float low, float high, float lod)
+{
+    float sum_noise = 0.0;
+
+    #pragma GCC unroll 16
+    for(int octave = C::start; octave < C::end; octave += 1) {
+
+        if (lod <= octave)
+            break;
+
+        sum_noise += simplex_octave<C>(x, y, z, octave) * octave_weight(lod, octave) * C::amplitude(octave);
+
+        float upper = (sum_noise + C::remaining_amplitude(octave) + 1) / 2;
+        float lower = (sum_noise - C::remaining_amplitude(octave) + 1) / 2;
+
+        if (upper < low)
+            return upper;
+
+        if (lower > high)
+            return lower;
+    }
+
+    return (sum_noise + 1) / 2;
+}
+
+// how many cells of an octave upper_bound() may look at before it falls
+// back to the octave amplitude
+#define BOUND_CELLS 64
+
+// perlin_slice::upper_bound()
+template <class C>
+static float slice_upper_bound(const float *lattice, const size_t *offsets, bool simplex, float x_min, float y_min,
+    float x_max, float y_max, float min_lod)
+{
+    float sum_noise = 0.0;
+
+    for(int octave = C::start; octave < C::end; octave += 1) {
+
+        if (simplex) {   // no lattice values to bound the octave by
+            sum_noise += C::amplitude(octave);
+            continue;
+        }
+
+        int shift = C::width_bits - octave;
+        int cells = 1 << octave;
+        const float *values = lattice + offsets[octave - C::start];
+        float amplitude = C::amplitude(octave);
+
+        int i_min = (int)x_min >> shift;
+        int i_max = (int)x_max >> shift;
+        int j_min = (int)y_min >> shift;
+        int j_max = (int)y_max >> shift;
+
+        if ((i_max - i_min + 1) * (j_max - j_min + 1) > BOUND_CELLS) {
+            sum_noise += amplitude;
+            continue;
+        }
+
+        // the bilinear interpolation is linear along both axes, so over a
+        // part of a cell it is the largest in one of the part's corners
+        float maximum = -1.0f;
+
+        for (int j_0 = j_min; j_0 <= j_max; j_0++) {
+            const float *row_0 = values + j_0 * (cells + 1);
+            const float *row_1 = values + ((j_0 + 1) & (cells - 1)) * (cells + 1);
+            float y_t[2] = {fmaxf(y_min - (j_0 << shift), 0.0f) * (1.0f / (1 << shift)),
+                fminf(y_max - (j_0 << shift), 1 << shift) * (1.0f / (1 << shift))};
+
+            for (int i_0 = i_min; i_0 <= i_max; i_0++) {
+                int i_1 = (i_0 + 1) & (cells - 1);
+                float x_t[2] = {fmaxf(x_min - (i_0 << shift), 0.0f) * (1.0f / (1 << shift)),
+                    fminf(x_max - (i_0 << shift), 1 << shift) * (1.0f / (1 << shift))};
+
+                for (int k = 0; k < 2; k++) {
+                    float b_0 = interpolate(row_0[i_0], row_0[i_1], x_t[k]);
+                    float b_1 = interpolate(row_1[i_0], row_1[i_1], x_t[k]);
+
+                    maximum = fmaxf(maximum, fmaxf(interpolate(b_0, b_1, y_t[0]), interpolate(b_0, b_1, y_t[1])));
+                }
+            }
+        }
+
+        if (min_lod < octave + 1)   // the octave may be faded out, which pulls it towards 0
+            maximum = fmaxf(maximum, 0.0f);
+
+        sum_noise += maximum * amplitude;
+    }
+
+    return (sum_noise + 1) / 2 + BOUND_MARGIN;
+}
+
+#ifdef PERLIN_X86
+
+/*
+ * The SIMD kernels below do exactly the same operations as perlin() and
+ * noise_legacy(), in the same order, so that every lane gives a bit-identical
+ * result. The integer divisions and modulos by powers of two round towards
+ * zero like C does, and the hash value is converted to float as
+ * (2^30 - h) * 2^-30, which is the same number as (float) (1.0 - h / 2^30).
+ */
+
+#define NOISE_SCALE (1.0f / 1073741824.0f)
+
+// 32 bit multiplication, SSE2 only has 32x32 -> 64 bit one
+static inline __m128i mullo_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128 noise_sse2(__m128i x, __m128i y, __m128i z)
+{
+    __m128i n;
+
+    n = _mm_add_epi32(_mm_add_epi32(x, mullo_sse2(y, _mm_set1_epi32(57))), mullo_sse2(z, _mm_set1_epi32(23)));
+    n = _mm_xor_si128(_mm_slli_epi32(n, 13), n);
+    n = _mm_add_epi32(mullo_sse2(n, _mm_add_epi32(mullo_sse2(mullo_sse2(n, n), _mm_set1_epi32(15731)),
+        _mm_set1_epi32(789221))), _mm_set1_epi32(1376312589));
+    n = _mm_and_si128(n, _mm_set1_epi32(0x7fffffff));
+
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_set1_epi32(0x40000000), n)), _mm_set1_ps(NOISE_SCALE));
+}
+
+// (v / (1 << shift)) * (1 << shift)
+static inline __m128i cell_start_sse2(__m128i v, __m128i shift, __m128i mask)
+{
+    __m128i bias = _mm_and_si128(_mm_srai_epi32(v, 31), mask);
+
+    return _mm_sll_epi32(_mm_sra_epi32(_mm_add_epi32(v, bias), shift), shift);
+}
+
+static inline __m128 interpolate_sse2(__m128 a, __m128 b, __m128 t)
+{
+    return _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(b, a)), a);
+}
+
+template <class C>
+static void perlin_batch_sse2(const float *x, const float *y, const float *z, float *out, size_t n)
+{
+    size_t i;
+    __m128i width_shift = _mm_cvtsi32_si128(C::width_bits);
+    __m128i width_mask = _mm_set1_epi32(C::width - 1);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 xf = _mm_loadu_ps(x + i);
+        __m128 yf = _mm_loadu_ps(y + i);
+        __m128 zf = _mm_loadu_ps(z + i);
+        __m128i xi = _mm_cvttps_epi32(xf);
+        __m128i yi = _mm_cvttps_epi32(yf);
+        __m128i zi = _mm_cvttps_epi32(zf);
+        __m128 sum_noise = _mm_setzero_ps();
+
+        #pragma GCC unroll 16
+        for (int octave = C::start; octave < C::end; octave += 1) {
+            __m128i shift = _mm_cvtsi32_si128(C::width_bits - octave);
+            __m128i mask = _mm_set1_epi32((C::width >> octave) - 1);
+            __m128i sample = _mm_set1_epi32(C::width >> octave);
+            __m128 sample_f = _mm_set1_ps((float) (C::width >> octave));
+
+            __m128i x_0 = cell_start_sse2(xi, shift, mask);
+            __m128i x_1 = _mm_add_epi32(x_0, sample);
+            x_1 = _mm_sub_epi32(x_1, cell_start_sse2(x_1, width_shift, width_mask));
+            __m128i y_0 = cell_start_sse2(yi, shift, mask);
+            __m128i y_1 = _mm_add_epi32(y_0, sample);
+            y_1 = _mm_sub_epi32(y_1, cell_start_sse2(y_1, width_shift, width_mask));
+            __m128i z_0 = cell_start_sse2(zi, shift, mask);
+            __m128i z_1 = _mm_add_epi32(z_0, sample);
+            z_1 = _mm_sub_epi32(z_1, cell_start_sse2(z_1, width_shift, width_mask));
+
+            __m128 x_t = _mm_div_ps(_mm_sub_ps(xf, _mm_cvtepi32_ps(x_0)), sample_f);
+            __m128 y_t = _mm_div_ps(_mm_sub_ps(yf, _mm_cvtepi32_ps(y_0)), sample_f);
+            __m128 z_t = _mm_div_ps(_mm_sub_ps(zf, _mm_cvtepi32_ps(z_0)), sample_f);
+
+            __m128 b_0 = interpolate_sse2(noise_sse2(x_0, y_0, z_0), noise_sse2(x_1, y_0, z_0), x_t);
+            __m128 b_1 = interpolate_sse2(noise_sse2(x_0, y_1, z_0), noise_sse2(x_1, y_1, z_0), x_t);
+            __m128 b_2 = interpolate_sse2(noise_sse2(x_0, y_0, z_1), noise_sse2(x_1, y_0, z_1), x_t);
+            __m128 b_3 = interpolate_sse2(noise_sse2(x_0, y_1, z_1), noise_sse2(x_1, y_1, z_1), x_t);
+            __m128 c_0 = interpolate_sse2(b_0, b_1, y_t);
+            __m128 c_1 = interpolate_sse2(b_2, b_3, y_t);
+            __m128 d_0 = interpolate_sse2(c_0, c_1, z_t);
+
+            sum_noise = _mm_add_ps(sum_noise, _mm_mul_ps(d_0, _mm_set1_ps(C::amplitude(octave))));
+        }
+
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_add_ps(sum_noise, _mm_set1_ps(1.0f)), _mm_set1_ps(0.5f)));
+    }
+
+    for (; i < n; i++)
+        out[i] = octave_sum<C>(x[i], y[i], z[i]);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256 noise_avx2(__m256i x, __m256i y, __m256i z)
+{
+    __m256i n;
+
+    n = _mm256_add_epi32(_mm256_add_epi32(x, _mm256_mullo_epi32(y, _mm256_set1_epi32(57))),
+        _mm256_mullo_epi32(z, _mm256_set1_epi32(23)));
+    n = _mm256_xor_si256(_mm256_slli_epi32(n, 13), n);
+    n = _mm256_add_epi32(_mm256_mullo_epi32(n, _mm256_add_epi32(_mm256_mullo_epi32(_mm256_mullo_epi32(n, n),
+        _mm256_set1_epi32(15731)), _mm256_set1_epi32(789221))), _mm256_set1_epi32(1376312589));
+    n = _mm256_and_si256(n, _mm256_set1_epi32(0x7fffffff));
+
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_set1_epi32(0x40000000), n)),
+        _mm256_set1_ps(NOISE_SCALE));
+}
+
+static inline AVX2 __m256i cell_start_avx2(__m256i v, __m128i shift, __m256i mask)
+{
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi32(v, 31), mask);
+
+    return _mm256_sll_epi32(_mm256_sra_epi32(_mm256_add_epi32(v, bias), shift), shift);
+}
+
+static inline AVX2 __m256 interpolate_avx2(__m256 a, __m256 b, __m256 t)
+{
+    return _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(b, a)), a);
+}
+
+template <class C>
+static AVX2 void perlin_batch_avx2(const float *x, const float *y, const float *z, float *out, size_t n)
+{
+    size_t i;
+    __m128i width_shift = _mm_cvtsi32_si128(C::width_bits);
+    __m256i width_mask = _mm256_set1_epi32(C::width - 1);
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 xf = _mm256_loadu_ps(x + i);
+        __m256 yf = _mm256_loadu_ps(y + i);
+        __m256 zf = _mm256_loadu_ps(z + i);
+        __m256i xi = _mm256_cvttps_epi32(xf);
+        __m256i yi = _mm256_cvttps_epi32(yf);
+        __m256i zi = _mm256_cvttps_epi32(zf);
+        __m256 sum_noise = _mm256_setzero_ps();
+
+        #pragma GCC unroll 16
+        for (int octave = C::start; octave < C::end; octave += 1) {
+            __m128i shift = _mm_cvtsi32_si128(C::width_bits - octave);
+            __m256i mask = _mm256_set1_epi32((C::width >> octave) - 1);
+            __m256i sample = _mm256_set1_epi32(C::width >> octave);
+            __m256 sample_f = _mm256_set1_ps((float) (C::width >> octave));
+
+            __m256i x_0 = cell_start_avx2(xi, shift, mask);
+            __m256i x_1 = _mm256_add_epi32(x_0, sample);
+            x_1 = _mm256_sub_epi32(x_1, cell_start_avx2(x_1, width_shift, width_mask));
+            __m256i y_0 = cell_start_avx2(yi, shift, mask);
+            __m256i y_1 = _mm256_add_epi32(y_0, sample);
+            y_1 = _mm256_sub_epi32(y_1, cell_start_avx2(y_1, width_shift, width_mask));
+            __m256i z_0 = cell_start_avx2(zi, shift, mask);
+            __m256i z_1 = _mm256_add_epi32(z_0, sample);
+            z_1 = _mm256_sub_epi32(z_1, cell_start_avx2(z_1, width_shift, width_mask));
+
+            __m256 x_t = _mm256_div_ps(_mm256_sub_ps(xf, _mm256_cvtepi32_ps(x_0)), sample_f);
+            __m256 y_t = _mm256_div_ps(_mm256_sub_ps(yf, _mm256_cvtepi32_ps(y_0)), sample_f);
+            __m256 z_t = _mm256_div_ps(_mm256_sub_ps(zf, _mm256_cvtepi32_ps(z_0)), sample_f);
+
+            __m256 b_0 = interpolate_avx2(noise_avx2(x_0, y_0, z_0), noise_avx2(x_1, y_0, z_0), x_t);
+            __m256 b_1 = interpolate_avx2(noise_avx2(x_0, y_1, z_0), noise_avx2(x_1, y_1, z_0), x_t);
+            __m256 b_2 = interpolate_avx2(noise_avx2(x_0, y_0, z_1), noise_avx2(x_1, y_0, z_1), x_t);
+            __m256 b_3 = interpolate_avx2(noise_avx2(x_0, y_1, z_1), noise_avx2(x_1, y_1, z_1), x_t);
+            __m256 c_0 = interpolate_avx2(b_0, b_1, y_t);
+            __m256 c_1 = interpolate_avx2(b_2, b_3, y_t);
+            __m256 d_0 = interpolate_avx2(c_0, c_1, z_t);
+
+            sum_noise = _mm256_add_ps(sum_noise, _mm256_mul_ps(d_0, _mm256_set1_ps(C::amplitude(octave))));
+        }
+
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_add_ps(sum_noise, _mm256_set1_ps(1.0f)), _mm256_set1_ps(0.5f)));
+    }
+
+    perlin_batch_sse2<C>(x + i, y + i, z + i, out + i, n - i);
+}
+
+template <class C>
+static AVX2 void slice_batch_avx2(const float *lattice, const size_t *offsets, const float *x, const float *y,
+    const float *lod, float low, float high, float *out, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 xf = _mm256_loadu_ps(x + i);
+        __m256 yf = _mm256_loadu_ps(y + i);
+        __m256 lodf = lod != NULL ? _mm256_loadu_ps(lod + i) : _mm256_set1_ps(HUGE_VALF);
+        __m256i xi = _mm256_cvttps_epi32(xf);
+        __m256i yi = _mm256_cvttps_epi32(yf);
+        __m256 sum_noise = _mm256_setzero_ps();
+        __m256 result = _mm256_setzero_ps();
+        __m256 done = _mm256_setzero_ps();   // lanes that terminated early, their result is set
+
+        #pragma GCC unroll 16
+        for (int octave = C::start; octave < C::end; octave += 1) {
+            __m256 weight = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(lodf, _mm256_set1_ps(octave)),
+                _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+
+            if (_mm256_movemask_ps(_mm256_cmp_ps(weight, _mm256_setzero_ps(), _CMP_GT_OQ)) == 0)
+                break;   // the remaining octaves are left out in all lanes
+
+            __m128i shift = _mm_cvtsi32_si128(C::width_bits - octave);
+            __m256i last = _mm256_set1_epi32((1 << octave) - 1);
+            __m256i stride = _mm256_set1_epi32((1 << octave) + 1);
+            __m256 size = _mm256_set1_ps(1.0f / (1 << (C::width_bits - octave)));
+            const float *values = lattice + offsets[octave - C::start];
+
+            __m256i i_0 = _mm256_sra_epi32(xi, shift);
+            __m256i i_1 = _mm256_and_si256(_mm256_add_epi32(i_0, _mm256_set1_epi32(1)), last);
+            __m256i j_0 = _mm256_sra_epi32(yi, shift);
+            __m256i j_1 = _mm256_and_si256(_mm256_add_epi32(j_0, _mm256_set1_epi32(1)), last);
+            __m256i row_0 = _mm256_mullo_epi32(j_0, stride);
+            __m256i row_1 = _mm256_mullo_epi32(j_1, stride);
+
+            __m256 x_t = _mm256_mul_ps(_mm256_sub_ps(xf, _mm256_cvtepi32_ps(_mm256_sll_epi32(i_0, shift))), size);
+            __m256 y_t = _mm256_mul_ps(_mm256_sub_ps(yf, _mm256_cvtepi32_ps(_mm256_sll_epi32(j_0, shift))), size);
+
+            __m256 b_0 = interpolate_avx2(_mm256_i32gather_ps(values, _mm256_add_epi32(row_0, i_0), 4),
+                _mm256_i32gather_ps(values, _mm256_add_epi32(row_0, i_1), 4), x_t);
+            __m256 b_1 = interpolate_avx2(_mm256_i32gather_ps(values, _mm256_add_epi32(row_1, i_0), 4),
+                _mm256_i32gather_ps(values, _mm256_add_epi32(row_1, i_1), 4), x_t);
+            __m256 c_0 = _mm256_mul_ps(interpolate_avx2(b_0, b_1, y_t), weight);
+
+            sum_noise = _mm256_add_ps(sum_noise, _mm256_mul_ps(c_0, _mm256_set1_ps(C::amplitude(octave))));
+
+            __m256 rest = _mm256_set1_ps(C::remaining_amplitude(octave));
+            __m256 upper = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(sum_noise, rest), _mm256_set1_ps(1.0f)), _mm256_set1_ps(0.5f));
+            __m256 lower = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(sum_noise, rest), _mm256_set1_ps(1.0f)), _mm256_set1_ps(0.5f));
+            __m256 below = _mm256_andnot_ps(done, _mm256_cmp_ps(upper, _mm256_set1_ps(low), _CMP_LT_OQ));
+            __m256 above = _mm256_andnot_ps(done, _mm256_cmp_ps(lower, _mm256_set1_ps(high), _CMP_GT_OQ));
+
+            result = _mm256_blendv_ps(result, upper, below);
+            result = _mm256_blendv_ps(result, lower, above);
+            done = _mm256_or_ps(done, _mm256_or_ps(below, above));
+
+            if (_mm256_movemask_ps(done) == 0xff)
+                break;
+        }
+
+        result = _mm256_blendv_ps(_mm256_mul_ps(_mm256_add_ps(sum_noise, _mm256_set1_ps(1.0f)), _mm256_set1_ps(0.5f)),
+            result, done);
+        _mm256_storeu_ps(out + i, result);
+    }
+
+    for (; i < n; i++)
+        out[i] = slice_sample<C>(lattice, offsets, x[i], y[i], low, high, lod != NULL ? lod[i] : HUGE_VALF);
+}
+
+#define AVX512 __attribute__((target("avx512f")))
+
+// the AVX-512 intrinsics start from undefined registers (__Y = __Y), which
+// some GCC versions wrongly report as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+static inline AVX512 __m512 interpolate_avx512(__m512 a, __m512 b, __m512 t)
+{
+    return _mm512_add_ps(_mm512_mul_ps(t, _mm512_sub_ps(b, a)), a);
+}
+
+// slice_batch_avx2() with 16 lanes, the lane masks are mask registers
+template <class C>
+static AVX512 void slice_batch_avx512(const float *lattice, const size_t *offsets, const float *x, const float *y,
+    const float *lod, float low, float high, float *out, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m512 xf = _mm512_loadu_ps(x + i);
+        __m512 yf = _mm512_loadu_ps(y + i);
+        __m512 lodf = lod != NULL ? _mm512_loadu_ps(lod + i) : _mm512_set1_ps(HUGE_VALF);
+        __m512i xi = _mm512_cvttps_epi32(xf);
+        __m512i yi = _mm512_cvttps_epi32(yf);
+        __m512 sum_noise = _mm512_setzero_ps();
+        __m512 result = _mm512_setzero_ps();
+        __mmask16 done = 0;
+
+        #pragma GCC unroll 16
+        for (int octave = C::start; octave < C::end; octave += 1) {
+            __m512 weight = _mm512_min_ps(_mm512_max_ps(_mm512_sub_ps(lodf, _mm512_set1_ps(octave)),
+                _mm512_setzero_ps()), _mm512_set1_ps(1.0f));
+
+            if (_mm512_cmp_ps_mask(weight, _mm512_setzero_ps(), _CMP_GT_OQ) == 0)
+                break;
+
+            __m128i shift = _mm_cvtsi32_si128(C::width_bits - octave);
+            __m512i last = _mm512_set1_epi32((1 << octave) - 1);
+            __m512i stride = _mm512_set1_epi32((1 << octave) + 1);
+            __m512 size = _mm512_set1_ps(1.0f / (1 << (C::width_bits - octave)));
+            const float *values = lattice + offsets[octave - C::start];
+
+            __m512i i_0 = _mm512_sra_epi32(xi, shift);
+            __m512i i_1 = _mm512_and_si512(_mm512_add_epi32(i_0, _mm512_set1_epi32(1)), last);
+            __m512i j_0 = _mm512_sra_epi32(yi, shift);
+            __m512i j_1 = _mm512_and_si512(_mm512_add_epi32(j_0, _mm512_set1_epi32(1)), last);
+            __m512i row_0 = _mm512_mullo_epi32(j_0, stride);
+            __m512i row_1 = _mm512_mullo_epi32(j_1, stride);
+
+            __m512 x_t = _mm512_mul_ps(_mm512_sub_ps(xf, _mm512_cvtepi32_ps(_mm512_sll_epi32(i_0, shift))), size);
+            __m512 y_t = _mm512_mul_ps(_mm512_sub_ps(yf, _mm512_cvtepi32_ps(_mm512_sll_epi32(j_0, shift))), size);
+
+            __m512 b_0 = interpolate_avx512(_mm512_i32gather_ps(_mm512_add_epi32(row_0, i_0), values, 4),
+                _mm512_i32gather_ps(_mm512_add_epi32(row_0, i_1), values, 4), x_t);
+            __m512 b_1 = interpolate_avx512(_mm512_i32gather_ps(_mm512_add_epi32(row_1, i_0), values, 4),
+                _mm512_i32gather_ps(_mm512_add_epi32(row_1, i_1), values, 4), x_t);
+            __m512 c_0 = _mm512_mul_ps(interpolate_avx512(b_0, b_1, y_t), weight);
+
+            sum_noise = _mm512_add_ps(sum_noise, _mm512_mul_ps(c_0, _mm512_set1_ps(C::amplitude(octave))));
+
+            __m512 rest = _mm512_set1_ps(C::remaining_amplitude(octave));
+            __m512 upper = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(sum_noise, rest), _mm512_set1_ps(1.0f)), _mm512_set1_ps(0.5f));
+            __m512 lower = _mm512_mul_ps(_mm512_add_ps(_mm512_sub_ps(sum_noise, rest), _mm512_set1_ps(1.0f)), _mm512_set1_ps(0.5f));
+            __mmask16 below = _mm512_cmp_ps_mask(upper, _mm512_set1_ps(low), _CMP_LT_OQ) & ~done;
+            __mmask16 above = _mm512_cmp_ps_mask(lower, _mm512_set1_ps(high), _CMP_GT_OQ) & ~done;
+
+            result = _mm512_mask_blend_ps(below, result, upper);
+            result = _mm512_mask_blend_ps(above, result, lower);
+            done |= below | above;
+
+            if (done == 0xffff)
+                break;
+        }
+
+        result = _mm512_mask_blend_ps(done, _mm512_mul_ps(_mm512_add_ps(sum_noise, _mm512_set1_ps(1.0f)),
+            _mm512_set1_ps(0.5f)), result);
+        _mm512_storeu_ps(out + i, result);
+    }
+
+    slice_batch_avx2<C>(lattice, offsets, x + i, y + i, lod != NULL ? lod + i : NULL, low, high, out + i, n - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // PERLIN_X86
+
+// fallback for the cases without a SIMD kernel, the samples usually come
+// from one line so the row sampler saves most of the lattice hashing of
+// the value noise
+static void perlin_batch_scalar(const float *x, const float *y, const float *z, float *out, size_t n)
+{
+    perlin_row_sampler sampler;
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = sampler.sample(x[i], y[i], z[i]);
+}
+
+template <class C>
+static void slice_batch_scalar(const float *lattice, const size_t *offsets, const float *x, const float *y,
+    const float *lod, float low, float high, float *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = slice_sample<C>(lattice, offsets, x[i], y[i], low, high, lod != NULL ? lod[i] : HUGE_VALF);
+}
+
+/*
+ * Functions of one octave preset, the SIMD kernels are selected by
+ * perlin_dispatch(). The SIMD perlin_batch() kernels only do the value
+ * noise with the legacy hash.
+ */
+struct octave_kernels
+{
+    float (*perlin)(float x, float y, float z);
+    float (*perlin_thresholded)(float x, float y, float z, float threshold);
+    float (*row_sample)(int *cell_x, int *cell_y, int *cell_z, float (*corners)[8], float x, float y, float z);
+    void (*perlin_batch_legacy)(const float *x, const float *y, const float *z, float *out, size_t n);
+    void (*slice_build)(float z, std::vector<float> &lattice, size_t *offsets);
+    float (*slice_upper_bound)(const float *lattice, const size_t *offsets, bool simplex, float x_min, float y_min,
+        float x_max, float y_max, float min_lod);
+    float (*slice_sample)(const float *lattice, const size_t *offsets, float x, float y, float low, float high,
+        float lod);
+    float (*simplex_sample)(float x, float y, float z, float low, float high, float lod);
+    void (*slice_batch)(const float *lattice, const size_t *offsets, const float *x, const float *y,
+        const float *lod, float low, float high, float *out, size_t n);
+};
+
+template <class C>
+static octave_kernels scalar_kernels()
+{
+    octave_kernels kernels;
+
+    kernels.perlin = octave_sum<C>;
+    kernels.perlin_thresholded = octave_sum_thresholded<C>;
+    kernels.row_sample = row_sample<C>;
+    kernels.perlin_batch_legacy = perlin_batch_scalar;
+    kernels.slice_build = slice_build<C>;
+    kernels.slice_upper_bound = slice_upper_bound<C>;
+    kernels.slice_sample = slice_sample<C>;
+    kernels.simplex_sample = simplex_sample<C>;
+    kernels.slice_batch = slice_batch_scalar<C>;
+
+    return kernels;
+}
+
+// indexed by perlin_octave_preset
+static octave_kernels presets[3] = {scalar_kernels<octaves_fast>(), scalar_kernels<octaves_default>(),
+    scalar_kernels<octaves_high>()};
+static perlin_octave_preset current_preset = PERLIN_OCTAVES_DEFAULT;
+
+template <class C>
+static void select_kernels(octave_kernels &kernels, simd_level level, simd_level &batch_level,
+    simd_level &slice_level)
+{
+    kernels = scalar_kernels<C>();
+    batch_level = SIMD_GENERIC;
+    slice_level = SIMD_GENERIC;
+
+#ifdef PERLIN_X86
+    if (level >= SIMD_AVX2) {
+        kernels.perlin_batch_legacy = perlin_batch_avx2<C>;
+        batch_level = SIMD_AVX2;
+    } else if (level >= SIMD_SSE2) {
+        kernels.perlin_batch_legacy = perlin_batch_sse2<C>;
+        batch_level = SIMD_SSE2;
+    }
+
+    if (level >= SIMD_AVX512) {
+        kernels.slice_batch = slice_batch_avx512<C>;
+        slice_level = SIMD_AVX512;
+    } else if (level >= SIMD_AVX2) {
+        kernels.slice_batch = slice_batch_avx2<C>;
+        slice_level = SIMD_AVX2;
+    }
+#endif
+}
+
+void perlin_dispatch(simd_level level)
+{
+    simd_level batch_level, slice_level;
+
+    // all the presets have the same variants
+    select_kernels<octaves_fast>(presets[PERLIN_OCTAVES_FAST], level, batch_level, slice_level);
+    select_kernels<octaves_default>(presets[PERLIN_OCTAVES_DEFAULT], level, batch_level, slice_level);
+    select_kernels<octaves_high>(presets[PERLIN_OCTAVES_HIGH], level, batch_level, slice_level);
+
+    dispatch_record("perlin_batch", batch_level);
+    dispatch_record("perlin_slice", slice_level);
+}
+
+void perlin_set_octave_preset(perlin_octave_preset preset)
+{
+    current_preset = preset;
+}
+
+perlin_octave_preset perlin_get_octave_preset()
+{
+    return current_preset;
+}
+
+float perlin(float x, float y, float z)
+{
+    return presets[current_preset].perlin(x, y, z);
+}
+
+float perlin_thresholded(float x, float y, float z, float threshold)
+{
+    return presets[current_preset].perlin_thresholded(x, y, z, threshold);
+}
+
+float perlin_row_sampler::sample(float x, float y, float z)
+{
+    if (use_simplex)   // no lattice cells to keep
+        return perlin(x, y, z);
+
+    return presets[current_preset].row_sample(this->cell_x, this->cell_y, this->cell_z, this->corners, x, y, z);
+}
+
+void perlin_batch(const float *x, const float *y, const float *z, float *out, size_t n)
+{
+    if (use_table || use_simplex)
+        perlin_batch_scalar(x, y, z, out, n);
+    else
+        presets[current_preset].perlin_batch_legacy(x, y, z, out, n);
+}
+
+perlin_slice::perlin_slice(float z)
+{
+    this->z = z;
+    this->simplex = use_simplex;
+    this->preset = current_preset;
+
+    if (!this->simplex)   // the simplex noise is evaluated directly
+        presets[this->preset].slice_build(z, this->lattice, this->offsets);
+}
+
+float perlin_slice::sample(float x, float y)
+{
+    if (this->simplex)
+        return presets[this->preset].simplex_sample(x, y, this->z, -HUGE_VALF, HUGE_VALF, HUGE_VALF);
+
+    return presets[this->preset].slice_sample(this->lattice.data(), this->offsets, x, y, -HUGE_VALF, HUGE_VALF,
+        HUGE_VALF);
+}
+
+float perlin_slice::sample_thresholded(float x, float y, float threshold)
+{
+    if (this->simplex)
+        return presets[this->preset].simplex_sample(x, y, this->z, threshold - BOUND_MARGIN, 1 + BOUND_MARGIN,
+            HUGE_VALF);
+
+    return presets[this->preset].slice_sample(this->lattice.data(), this->offsets, x, y, threshold - BOUND_MARGIN,
+        1 + BOUND_MARGIN, HUGE_VALF);
+}
+
+float perlin_slice::upper_bound(float x_min, float y_min, float x_max, float y_max, float min_lod)
+{
+    return presets[this->preset].slice_upper_bound(this->lattice.data(), this->offsets, this->simplex, x_min, y_min,
+        x_max, y_max, min_lod);
+}
+
+void perlin_slice::batch(const float *x, const float *y, const float *lod, float low, float high, float *out, size_t n)
+{
+    const octave_kernels *kernels = &presets[this->preset];
+
+    if (this->simplex) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = kernels->simplex_sample(x[i], y[i], this->z, low, high, lod != NULL ? lod[i] : HUGE_VALF);
+
+        return;
+    }
+
+    kernels->slice_batch(this->lattice.data(), this->offsets, x, y, lod, low, high, out, n);
+}
+
+void perlin_slice::sample_batch(const float *x, const float *y, float *out, size_t n)
+{
+    this->batch(x, y, NULL, -HUGE_VALF, HUGE_VALF, out, n);
+}
+
+void perlin_slice::sample_batch_thresholded(const float *x, const float *y, float threshold, float *out, size_t n)
+{
+    this->batch(x, y, NULL, threshold - BOUND_MARGIN, 1 + BOUND_MARGIN, out, n);
+}
+
+void perlin_slice::sample_batch_lod(const float *x, const float *y, const float *lod, float threshold, float *out,
+    size_t n)
+{
+    this->batch(x, y, lod, threshold - BOUND_MARGIN, 1 + BOUND_MARGIN, out, n);
+}
@@ -1,8 +1,222 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <stddef.h>
+#include <math.h>
+#include <vector>
+
 #define PERLIN_WIDTH 1024
+#define PERLIN_MAX_OCTAVES 16  // upper bound on the number of summed octaves
+
+enum perlin_noise_type    /**< kind of noise summed in the octaves */
+  {
+    PERLIN_NOISE_VALUE,     ///< trilinearly interpolated lattice values, 8 corners per octave (default)
+    PERLIN_NOISE_SIMPLEX    ///< simplex noise, 4 corners per octave
+  };
+
+enum perlin_octave_preset  /**< which octaves are summed, octave o has 2^o lattice cells across PERLIN_WIDTH */
+  {
+    PERLIN_OCTAVES_FAST,    ///< octaves 3 to 7, less detail
+    PERLIN_OCTAVES_DEFAULT, ///< octaves 3 to 9 (default)
+    PERLIN_OCTAVES_HIGH     ///< octaves 3 to 10, the finest cells are 1 wide
+  };
 
 float perlin(float x, float y, float z);
 
+float perlin_thresholded(float x, float y, float z, float threshold);
+    /**<
+     Same as perlin() as long as the result is in range <threshold,1>.
+     The octave sum stops as soon as the remaining octaves can't lift it
+     to the threshold anymore, or can't bring it under 1. A value under
+     the threshold or over 1 is returned then, respectively. This is
+     enough for the cloud mapping, which turns everything under the
+     threshold into clear sky and saturates at 1.
+
+     @param threshold noise value under which the exact result is not
+            needed
+     */
+
+void perlin_init(unsigned int seed);
+    /**<
+     Switches the noise to the permutation table backend and builds the
+     table from given seed. Different seeds give different cloud fields.
+
+     @param seed seed of the permutation and lattice value tables
+     */
+
+void perlin_init_legacy();
+    /**<
+     Switches the noise back to the original arithmetic lattice hash,
+     which is the default. It has no seed and renders the same clouds as
+     the previous versions of skygen.
+     */
+
+void perlin_set_noise_type(perlin_noise_type type);
+    /**<
+     Selects the noise summed in the octaves. Both types use the same
+     octaves and give values in the same range, period and lattice hash
+     (legacy or seeded table), but look different. All the functions here
+     follow it, a perlin_slice keeps the type it was made with.
+
+     @param type noise type, PERLIN_NOISE_VALUE is the default
+     */
+
+perlin_noise_type perlin_get_noise_type();
+
+void perlin_set_octave_preset(perlin_octave_preset preset);
+    /**<
+     Selects the octaves summed by all the functions here, a perlin_slice
+     keeps the preset it was made with. Each preset is a separate
+     instantiation of the noise code with the octave loops unrolled, so
+     the choice costs nothing per sample. The presets share their common
+     octaves, so the fast one only lacks the finest details of the default
+     one.
+
+     @param preset octave preset, PERLIN_OCTAVES_DEFAULT is the default
+     */
+
+perlin_octave_preset perlin_get_octave_preset();
+
+void perlin_batch(const float *x, const float *y, const float *z, float *out, size_t n);
+    /**<
+     Evaluates perlin() for n samples at once, using the SIMD kernel
+     selected by dispatch_init(). The results are bit-identical to calling
+     perlin() for each sample. The SIMD kernels only implement the legacy
+     hash and the value noise, otherwise the samples are evaluated one by one by
+     a perlin_row_sampler, so they should come from one line of one sky
+     plane.
+
+     @param x array of n x coordinates
+     @param y array of n y coordinates
+     @param z array of n z coordinates
+     @param out array into which the n noise values will be written
+     @param n number of samples
+     */
+
+class perlin_row_sampler
+  {
+    /**<
+     Evaluates perlin() for a sequence of nearby samples, such as the
+     pixels of one picture line on a sky plane. The noise of the 8 lattice
+     corners of each octave is kept and only recomputed when a sample
+     falls into another lattice cell, which for the low frequency octaves
+     happens only every few dozen pixels. The results are bit-identical to
+     perlin().
+     */
+
+    protected:
+      int cell_x[PERLIN_MAX_OCTAVES];      ///< lattice cell of the cached corners
+      int cell_y[PERLIN_MAX_OCTAVES];
+      int cell_z[PERLIN_MAX_OCTAVES];
+      float corners[PERLIN_MAX_OCTAVES][8];
+
+    public:
+      perlin_row_sampler();
+
+      void reset();
+        /**<
+          Forgets the cached corners, must be called when the noise backend
+          changes (perlin_init(), perlin_set_octave_preset()).
+          */
+
+      float sample(float x, float y, float z);
+        /**<
+          Same as perlin(x, y, z).
+          */
+  };
+
+class perlin_slice
+  {
+    /**<
+     Noise on a plane of constant z, like a sky plane in one frame. The
+     construction blends the two z layers of every octave into a 2D value
+     lattice, so a sample only needs a bilinear interpolation of 4 lattice
+     values per octave instead of hashing 8 corners. The results match
+     perlin() up to float rounding (the interpolation is done in a
+     different order). The simplex noise can't be blended like this, a
+     slice of it evaluates perlin() with its z.
+     */
+
+    protected:
+      std::vector<float> lattice;           ///< blended lattices of all octaves, one after another
+      size_t offsets[PERLIN_MAX_OCTAVES];   ///< where each octave starts in lattice
+      float z;
+      bool simplex;                         ///< simplex noise slice, it has no lattice
+      perlin_octave_preset preset;
+
+      void batch(const float *x, const float *y, const float *lod, float low, float high, float *out, size_t n);
+        /**<
+          Samples n points with the early termination bounds low and high
+          (see perlin_thresholded()) and levels of detail lod (can be
+          NULL).
+          */
+
+    public:
+      perlin_slice(float z);
+        /**<
+          Builds the blended lattices, this hashes every lattice point of
+          every octave twice, it pays off when the slice is sampled more
+          times than that (a few hundred thousand).
+
+          @param z z coordinate of the slice
+          */
+
+      float sample(float x, float y);
+        /**<
+          Same as perlin(x, y, z) up to float rounding.
+
+          @param x x coordinate in range <0,PERLIN_WIDTH>
+          @param y y coordinate in range <0,PERLIN_WIDTH>
+          */
+
+      float sample_thresholded(float x, float y, float threshold);
+        /**<
+          Same as sample() with the early termination of
+          perlin_thresholded().
+          */
+
+      float upper_bound(float x_min, float y_min, float x_max, float y_max, float min_lod = HUGE_VALF);
+        /**<
+          Gives a conservative upper bound of sample() over a rectangle. The
+          low octaves are bounded by their largest value in the corners of
+          the rectangle parts in each lattice cell (the interpolation is
+          linear along both axes), the octaves in which the rectangle
+          touches too many cells only by their amplitude. The octaves of
+          simplex noise are all bounded by their amplitude, so for it the
+          bound doesn't say much.
+
+          @param x_min left edge of the rectangle, in range <0,PERLIN_WIDTH>
+          @param y_min top edge of the rectangle, in range <0,PERLIN_WIDTH>
+          @param x_max right edge of the rectangle, in range <0,PERLIN_WIDTH>
+          @param y_max bottom edge of the rectangle, in range <0,PERLIN_WIDTH>
+          @param min_lod smallest level of detail used in the rectangle, see
+                 sample_batch_lod()
+          @return value that no sample() in the rectangle exceeds
+          */
+
+      void sample_batch(const float *x, const float *y, float *out, size_t n);
+        /**<
+          Calls sample() for n samples, 8 or 16 at a time with AVX2 or
+          AVX-512 gathers if dispatch_init() selected them.
+          */
+
+      void sample_batch_thresholded(const float *x, const float *y, float threshold, float *out, size_t n);
+        /**<
+          Calls sample_thresholded() for n samples, the SIMD kernel stops
+          when all of its 8 lanes are decided.
+          */
+
+      void sample_batch_lod(const float *x, const float *y, const float *lod, float threshold, float *out, size_t n);
+        /**<
+          Same as sample_batch_thresholded(), but each sample only sums the
+          octaves up to its level of detail. Octave o (with 2^o lattice
+          cells across PERLIN_WIDTH) gets the weight lod - o clamped to <0,1>,
+          so the octaves up to lod - 1 are complete, the next one fades
+          in smoothly as lod grows and the finer ones are left out.
+
+          @param lod array of n levels of detail, HUGE_VALF sums all the
+                 octaves
+          */
+  };
+
 #endif
@@ -0,0 +1,138 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**<
+ Bounded queue connecting the stages of the frame pipeline of skygen
+ (render, encode, write). push() blocks while the queue is full, which
+ holds the producing stage back, pop() blocks while it is empty. The
+ queue measures how full it gets and how long the stages wait on it.
+ */
+
+using namespace std;
+
+struct queue_statistics   /**< how a bounded_queue was used */
+  {
+    unsigned int max_depth;        ///< most items in the queue at once
+    double mean_depth;             ///< items in the queue after a push, averaged over the pushes
+    double push_stall;             ///< seconds the producers waited for room
+    double pop_stall;              ///< seconds the consumers waited for items
+  };
+
+template <typename T> class bounded_queue
+  {
+    protected:
+      deque<T> items;
+      unsigned int capacity;
+      bool closed;
+      mutex lock;
+      condition_variable not_full;
+      condition_variable not_empty;
+      unsigned long pushes;
+      unsigned long depth_sum;
+      unsigned int max_depth;
+      chrono::steady_clock::duration push_stall;
+      chrono::steady_clock::duration pop_stall;
+
+    public:
+      bounded_queue(unsigned int capacity)
+        /**<
+          @param capacity most items the queue can hold, at least 1
+          */
+        {
+          this->capacity = capacity;
+          this->closed = false;
+          this->pushes = 0;
+          this->depth_sum = 0;
+          this->max_depth = 0;
+          this->push_stall = chrono::steady_clock::duration(0);
+          this->pop_stall = chrono::steady_clock::duration(0);
+        }
+
+      void push(T item)
+        /**<
+          Adds an item to the end of the queue, waits while it's full.
+          */
+        {
+          unique_lock<mutex> guard(this->lock);
+
+          if (this->items.size() >= this->capacity)
+            {
+              chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+              while (this->items.size() >= this->capacity)
+                this->not_full.wait(guard);
+
+              this->push_stall += chrono::steady_clock::now() - start;
+            }
+
+          this->items.push_back(item);
+          this->pushes++;
+          this->depth_sum += this->items.size();
+          this->max_depth = max(this->max_depth,(unsigned int) this->items.size());
+          this->not_empty.notify_one();
+        }
+
+      bool pop(T &item)
+        /**<
+          Takes the item from the front of the queue, waits while it's
+          empty and not closed.
+
+          @param item into this variable the item will be written
+          @return true if an item was taken, false if the queue is closed
+                  and empty
+          */
+        {
+          unique_lock<mutex> guard(this->lock);
+
+          if (this->items.empty() && !this->closed)
+            {
+              chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+              while (this->items.empty() && !this->closed)
+                this->not_empty.wait(guard);
+
+              this->pop_stall += chrono::steady_clock::now() - start;
+            }
+
+          if (this->items.empty())
+            return false;
+
+          item = this->items.front();
+          this->items.pop_front();
+          this->not_full.notify_one();
+          return true;
+        }
+
+      void close()
+        /**<
+          Says no more items will be pushed, pop() stops waiting once the
+          queue is empty.
+          */
+        {
+          lock_guard<mutex> guard(this->lock);
+
+          this->closed = true;
+          this->not_empty.notify_all();
+        }
+
+      queue_statistics get_statistics()
+        {
+          lock_guard<mutex> guard(this->lock);
+          queue_statistics statistics;
+
+          statistics.max_depth = this->max_depth;
+          statistics.mean_depth = this->pushes == 0 ? 0 : this->depth_sum / ((double) this->pushes);
+          statistics.push_stall = chrono::duration<double>(this->push_stall).count();
+          statistics.pop_stall = chrono::duration<double>(this->pop_stall).count();
+
+          return statistics;
+        }
+  };
+
+#endif
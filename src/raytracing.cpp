@@ -1,4 +1,10 @@
 #include "raytracing.h"
+#include <algorithm>
+#include "dispatch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define RAYTRACING_X86
+#endif
 
 
 double saturate(double value, double min, double max)
@@ -53,7 +59,7 @@ double wrap(double value, double min, double max)
     while (value < min)
       value += difference;
 
-    while (value > max)
+    while (value >= max)   // max itself is min, the noise isn't periodic at its exact end
       value -= difference;
 
     return value;
@@ -62,52 +68,55 @@ double wrap(double value, double min, double max)
 // Metody point3D
 
 // vektorovy soucin
-point_3D point_3D::cross_product(point_3D src) {
-    return point_3D(this->y * src.z - this->z * src.y,
+template <typename real> basic_point_3D<real> basic_point_3D<real>::cross_product(basic_point_3D<real> src) {
+    return basic_point_3D<real>(this->y * src.z - this->z * src.y,
         this->z * src.x - this->x * src.z,
         this->x * src.y - this->y * src.x);
 }
 
 // skalarni soucin
-double point_3D::dot_product(point_3D src)
+template <typename real> real basic_point_3D<real>::dot_product(basic_point_3D<real> src)
 {
     return this->x * src.x + this->y * src.y + this->z * src.z;
 }
 
 // vzdalenost bodu od pocatku souradnic
-double point_3D::vector_length()
+template <typename real> real basic_point_3D<real>::vector_length()
   {
     return sqrt(this->dot_product(*this));
   }
 
 // vzdalenost od druheho bodu
-double point_3D::point_distance(point_3D src)
+template <typename real> real basic_point_3D<real>::point_distance(basic_point_3D<real> src)
   {
     return (*this - src).vector_length();
   }
 
 // normalizace delky vektoru
-void point_3D::normalize()
+template <typename real> void basic_point_3D<real>::normalize()
   {
-    double length = this->vector_length();
+    real length = this->vector_length();
     this->x /= length;
     this->y /= length;
     this->z /= length;
   }
 
 // uhel mezi vektory
-double point_3D::vectors_angle(point_3D src)
+template <typename real> real basic_point_3D<real>::vectors_angle(basic_point_3D<real> src)
   {
     return acos(this->dot_product(src) / this->vector_length() / src.vector_length());
   }
 
+template struct basic_point_3D<double>;
+template struct basic_point_3D<float>;    // the float lighting of skyrenderer
+
 // Metody triangle_3D
 
 // vraci obsah trojuhelnika
-double triangle_3D::area()
+template <typename real> real basic_triangle_3D<real>::area()
   {
-    double a_length, b_length, gamma;
-    point_3D a_vector, b_vector;
+    real a_length, b_length, gamma;
+    basic_point_3D<real> a_vector, b_vector;
 
     a_length = this->a.point_distance(this->b);
     b_length = this->a.point_distance(this->c);
@@ -121,17 +130,40 @@ double triangle_3D::area()
   }
 
 // TODO: co to dela?
-void triangle_3D::get_uvw(double barycentric_a, double barycentric_b, double barycentric_c, double &u, double &v, double &w)
+template <typename real> void basic_triangle_3D<real>::get_uvw(real barycentric_a, real barycentric_b, real barycentric_c, real &u,
+  real &v, real &w)
   {
     u = barycentric_a * this->a_t.x + barycentric_b * this->b_t.x + barycentric_c * this->c_t.x;
     v = barycentric_a * this->a_t.y + barycentric_b * this->b_t.y + barycentric_c * this->c_t.y;
     w = barycentric_a * this->a_t.z + barycentric_b * this->b_t.z + barycentric_c * this->c_t.z;
   }
 
+template struct basic_triangle_3D<double>;
+
+// Metody prepared_triangle
+
+template <typename real> basic_prepared_triangle<real>::basic_prepared_triangle(basic_triangle_3D<real> triangle) :
+  triangle(triangle)
+  {
+    this->edge1 = triangle.b - triangle.a;
+    this->edge2 = triangle.c - triangle.a;
+    this->normal = this->edge1.cross_product(this->edge2);
+  }
+
+template struct basic_prepared_triangle<double>;
+
+void prepare_triangles(vector<triangle_3D> *triangles, vector<prepared_triangle> *prepared)
+  {
+    prepared->clear();
+
+    for (unsigned int i = 0; i < triangles->size(); i++)
+      prepared->push_back(prepared_triangle((*triangles)[i]));
+  }
+
 // Metody line_3D
 
 // konstruktor
-line_3D::line_3D(point_3D point1, point_3D point2)
+template <typename real> basic_line_3D<real>::basic_line_3D(basic_point_3D<real> point1, basic_point_3D<real> point2)
   {
     this->c0 = point1.x;
     this->q0 = point2.x - point1.x;
@@ -141,19 +173,29 @@ line_3D::line_3D(point_3D point1, point_3D point2)
     this->q2 = point2.z - point1.z;
   }
 
+template <typename real> basic_point_3D<real> basic_line_3D<real>::get_origin()
+  {
+    return basic_point_3D<real>(this->c0,this->c1,this->c2);
+  }
+
+template <typename real> basic_point_3D<real> basic_line_3D<real>::get_direction()
+  {
+    return basic_point_3D<real>(this->q0,this->q1,this->q2);
+  }
+
 // vraci bod na primce dany parametrem t
-point_3D line_3D::get_point(const double t)
+template <typename real> basic_point_3D<real> basic_line_3D<real>::get_point(const real t)
   {
-    return point_3D(
+    return basic_point_3D<real>(
         this->c0 + this->q0 * t,
         this->c1 + this->q1 * t,
         this->c2 + this->q2 * t);
   }
 
 // vraci true pokud primka protina kouli sphere
-bool line_3D::intersects_sphere(sphere_3D sphere)
+template <typename real> bool basic_line_3D<real>::intersects_sphere(basic_sphere_3D<real> sphere)
   {
-    double a,b,c;
+    real a,b,c;
 
     a = this->q0 * this->q0 + this->q1 * this->q1 + this->q2 * this->q2;
     b = 2 * this->c0 * this->q0 - 2 * sphere.center.x * this->q0 +
@@ -168,9 +210,9 @@ bool line_3D::intersects_sphere(sphere_3D sphere)
   }
 
 // vraci smerovy vektor primky
-point_3D line_3D::get_vector_to_origin()
+template <typename real> basic_point_3D<real> basic_line_3D<real>::get_vector_to_origin()
   {
-    point_3D a,b,result;
+    basic_point_3D<real> a,b,result;
 
     a = this->get_point(0);
     b = this->get_point(1);
@@ -181,73 +223,488 @@ point_3D line_3D::get_vector_to_origin()
   }
 
 
-bool line_3D::intersects_triangle(triangle_3D triangle, double &a, double &b, double &c, double &t)
+template <typename real> bool basic_line_3D<real>::intersects_triangle(basic_triangle_3D<real> triangle, real &a,
+  real &b, real &c, real &t)
+  {
+    basic_prepared_triangle<real> prepared(triangle);
+
+    return this->intersects_triangle(&prepared,a,b,c,t);
+  }
+
+template <typename real> bool basic_line_3D<real>::intersects_triangle(basic_prepared_triangle<real> *triangle,
+  real &a, real &b, real &c, real &t)
   {
-    point_3D vector1,vector2,vector3,normal;
+    basic_point_3D<real> direction(this->q0,this->q1,this->q2);
+    basic_point_3D<real> origin(this->c0,this->c1,this->c2);
 
     a = 0.0;
     b = 0.0;
     c = 0.0;
 
-    vector1 = triangle.a - triangle.b;
-    vector2 = triangle.a - triangle.c;
+    // Moller-Trumbore, solves origin + t * direction = a + b * edge1 + c * edge2 by Cramer's rule
 
-    normal = vector1.cross_product(vector2);
+    basic_point_3D<real> p = direction.cross_product(triangle->edge2);
+    real determinant = triangle->edge1.dot_product(p);
 
-    /*
-     Compute general plane equation in form
-     qa * x + qb * y + qc * z + d = 0:
-     */
+    if (determinant == 0)   // the line is parallel with the triangle plane
+      return false;
 
-    double qa = normal.x;
-    double qb = normal.y;
-    double qc = normal.z;
-    double d = -1 * (qa * triangle.a.x + qb * triangle.a.y + qc * triangle.a.z);
+    real inverse = 1.0 / determinant;
+    basic_point_3D<real> to_origin = origin - triangle->triangle.a;
+    basic_point_3D<real> q = to_origin.cross_product(triangle->edge1);
 
-    /* Solve for t: */
+    real line_b = to_origin.dot_product(p) * inverse;
+    real line_c = direction.dot_product(q) * inverse;
 
-    double denominator = (qa * this->q0 + qb * this->q1 + qc * this->q2);
+    t = triangle->edge2.dot_product(q) * inverse;
 
-    if (denominator == 0)
+    if (line_b < 0 || line_c < 0 || line_b + line_c > 1 || t < 0)
       return false;
 
-    t = (-qa * this->c0 - qb * this->c1 - qc * this->c2 - d) / denominator;
+    a = 1 - line_b - line_c;
+    b = line_b;
+    c = line_c;
 
-    /* t now contains parameter value for the intersection */
+    return true;
+  }
 
-    if (t < 0.0)
-      return false;
+template class basic_line_3D<double>;
 
-    point_3D intersection;
+// Metody triangle_bvh
 
-    intersection = this->get_point(t);  // intersection in 3D space
+void triangle_bvh::build(vector<triangle_3D> *triangles)
+  {
+    vector<point_3D> centroids;
+    unsigned int i;
 
-    // vectors from the intersection to each triangle vertex:
+    prepare_triangles(triangles,&this->triangles);
+    this->nodes.clear();
+    this->order.clear();
 
-    vector1 = triangle.a - intersection;
-    vector2 = triangle.b - intersection;
-    vector3 = triangle.c - intersection;
+    for (i = 0; i < triangles->size(); i++)
+      {
+        triangle_3D *triangle = &(*triangles)[i];
 
-    point_3D normal1, normal2, normal3;
+        centroids.push_back(point_3D((triangle->a.x + triangle->b.x + triangle->c.x) / 3.0,
+          (triangle->a.y + triangle->b.y + triangle->c.y) / 3.0,(triangle->a.z + triangle->b.z + triangle->c.z) / 3.0));
+        this->order.push_back(i);
+      }
 
-    // now multiply the vectors to get their normals:
+    if (!triangles->empty())
+      this->build_node(&centroids,0,triangles->size(),0);
+  }
 
-    normal1 = vector1.cross_product(vector2);
-    normal2 = vector2.cross_product(vector3);
-    normal3 = vector3.cross_product(vector1);
+// postavi uzel nad trojuhelniky order[from] az order[to - 1], vraci jeho index
+unsigned int triangle_bvh::build_node(vector<point_3D> *centroids, unsigned int from, unsigned int to,
+  unsigned int depth)
+  {
+    unsigned int i, k, index = this->nodes.size();
+    double extent = 0;
+    bvh_node node;
+    point_3D centroid_min(HUGE_VAL,HUGE_VAL,HUGE_VAL), centroid_max(-HUGE_VAL,-HUGE_VAL,-HUGE_VAL);
 
-    // if one of the vectors points in other direction than the others, the point is not inside the triangle:
+    node.box_min = centroid_min;
+    node.box_max = centroid_max;
 
-    if (normal1.dot_product(normal2) < 0 || normal2.dot_product(normal3) < 0)
-      return false;
+    for (i = from; i < to; i++)
+      {
+        triangle_3D *triangle = &this->triangles[this->order[i]].triangle;
+        point_3D vertices[3] = {triangle->a, triangle->b, triangle->c};
+        point_3D *centroid = &(*centroids)[this->order[i]];
 
-    // now compute the barycentric coordinates:
+        for (k = 0; k < 3; k++)
+          {
+            node.box_min = point_3D(min(node.box_min.x,vertices[k].x),min(node.box_min.y,vertices[k].y),
+              min(node.box_min.z,vertices[k].z));
+            node.box_max = point_3D(max(node.box_max.x,vertices[k].x),max(node.box_max.y,vertices[k].y),
+              max(node.box_max.z,vertices[k].z));
+          }
 
-    double total_area = triangle.area();
+        centroid_min = point_3D(min(centroid_min.x,centroid->x),min(centroid_min.y,centroid->y),
+          min(centroid_min.z,centroid->z));
+        centroid_max = point_3D(max(centroid_max.x,centroid->x),max(centroid_max.y,centroid->y),
+          max(centroid_max.z,centroid->z));
+      }
 
-    a = triangle_3D(intersection, triangle.b, triangle.c).area()/total_area;
-    b = triangle_3D(triangle.a, intersection, triangle.c).area()/total_area;
-    c = triangle_3D(triangle.a, triangle.b, intersection).area()/total_area;
+    // the intersections at the triangle edges are rounded, the box mustn't miss them
+    double margin = 1e-9 * max(1.0,max(max(max(fabs(node.box_min.x),fabs(node.box_max.x)),
+      max(fabs(node.box_min.y),fabs(node.box_max.y))),max(fabs(node.box_min.z),fabs(node.box_max.z))));
 
-    return true;
+    node.box_min = point_3D(node.box_min.x - margin,node.box_min.y - margin,node.box_min.z - margin);
+    node.box_max = point_3D(node.box_max.x + margin,node.box_max.y + margin,node.box_max.z + margin);
+    node.first = from;
+    node.count = to - from;
+
+    this->nodes.push_back(node);
+
+    if (to - from <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+      return index;
+
+    // split in the middle of the longest centroid axis
+
+    double point_3D::*axis = &point_3D::x;
+
+    if (centroid_max.x - centroid_min.x > extent)
+      extent = centroid_max.x - centroid_min.x;
+
+    if (centroid_max.y - centroid_min.y > extent)
+      {
+        extent = centroid_max.y - centroid_min.y;
+        axis = &point_3D::y;
+      }
+
+    if (centroid_max.z - centroid_min.z > extent)
+      axis = &point_3D::z;
+
+    double middle = (centroid_min.*axis + centroid_max.*axis) / 2.0;
+    unsigned int *split = partition(this->order.data() + from,this->order.data() + to,
+      [centroids,axis,middle](unsigned int i) { return (*centroids)[i].*axis < middle; });
+
+    if (split == this->order.data() + from || split == this->order.data() + to)
+      {
+        // the centroids are all the same, split the triangles in halves
+
+        split = this->order.data() + (from + to) / 2;
+        nth_element(this->order.data() + from,split,this->order.data() + to,
+          [centroids,axis](unsigned int i, unsigned int j) { return (*centroids)[i].*axis < (*centroids)[j].*axis; });
+      }
+
+    unsigned int middle_index = split - this->order.data();
+
+    this->build_node(centroids,from,middle_index,depth + 1);
+    unsigned int second = this->build_node(centroids,middle_index,to,depth + 1);   // the nodes may be reallocated
+
+    this->nodes[index].first = second;
+    this->nodes[index].count = 0;
+
+    return index;
+  }
+
+vector<prepared_triangle> *triangle_bvh::get_triangles()
+  {
+    return &this->triangles;
+  }
+
+// slab test, near_t je parametr vstupu do boxu
+bool triangle_bvh::box_hit(bvh_node *node, point_3D origin, point_3D inverse_direction, double max_t,
+  double &near_t)
+  {
+    double from[3] = {node->box_min.x - origin.x, node->box_min.y - origin.y, node->box_min.z - origin.z};
+    double to[3] = {node->box_max.x - origin.x, node->box_max.y - origin.y, node->box_max.z - origin.z};
+    double inverse[3] = {inverse_direction.x, inverse_direction.y, inverse_direction.z};
+    double far_t = max_t;
+
+    near_t = 0;
+
+    for (unsigned int i = 0; i < 3; i++)
+      {
+        if (isinf(inverse[i]))   // parallel with the slab, 0 * inf would be NaN
+          {
+            if (from[i] > 0 || to[i] < 0)
+              return false;
+
+            continue;
+          }
+
+        double t1 = from[i] * inverse[i];
+        double t2 = to[i] * inverse[i];
+
+        near_t = max(near_t,min(t1,t2));
+        far_t = min(far_t,max(t1,t2));
+      }
+
+    return near_t <= far_t;
+  }
+
+int triangle_bvh::closest_hit(line_3D *line, double &a, double &b, double &c, double &t)
+  {
+    unsigned int stack[BVH_MAX_DEPTH + 2];   // each level adds at most one node to the stack
+    double stack_t[BVH_MAX_DEPTH + 2];
+    unsigned int size = 0, i;
+    int result = -1;
+    double near_t, line_a, line_b, line_c, line_t;
+    point_3D origin = line->get_origin();
+    point_3D direction = line->get_direction();
+    point_3D inverse_direction(1.0 / direction.x,1.0 / direction.y,1.0 / direction.z);
+
+    t = HUGE_VAL;
+
+    if (this->nodes.empty() || !this->box_hit(&this->nodes[0],origin,inverse_direction,HUGE_VAL,near_t))
+      return -1;
+
+    stack[size] = 0;
+    stack_t[size] = near_t;
+    size++;
+
+    while (size > 0)
+      {
+        size--;
+
+        if (stack_t[size] > t)   // a closer triangle has been found since the node was pushed
+          continue;
+
+        bvh_node *node = &this->nodes[stack[size]];
+
+        if (node->count != 0)
+          {
+            for (i = node->first; i < node->first + node->count; i++)
+              {
+                int index = this->order[i];
+
+                if (line->intersects_triangle(&this->triangles[index],line_a,line_b,line_c,line_t) &&
+                  (line_t < t || (line_t == t && index < result)))
+                  {
+                    result = index;
+                    a = line_a;
+                    b = line_b;
+                    c = line_c;
+                    t = line_t;
+                  }
+              }
+
+            continue;
+          }
+
+        // the closer child goes on the top of the stack to be visited first
+
+        unsigned int children[2] = {(unsigned int) (node - this->nodes.data()) + 1, node->first};
+        double children_t[2];
+        bool hit[2];
+
+        for (i = 0; i < 2; i++)
+          hit[i] = this->box_hit(&this->nodes[children[i]],origin,inverse_direction,t,children_t[i]);
+
+        unsigned int closer = children_t[1] < children_t[0] ? 1 : 0;
+
+        for (i = 0; i < 2; i++)
+          {
+            unsigned int child = i == 0 ? 1 - closer : closer;
+
+            if (hit[child])
+              {
+                stack[size] = children[child];
+                stack_t[size] = children_t[child];
+                size++;
+              }
+          }
+      }
+
+    return result;
+  }
+
+void triangle_bvh::frustum_triangles(point_3D origin, point_3D directions[4], vector<unsigned int> *result)
+  {
+    point_3D normals[4], inside = point_3D();
+    unsigned int stack[BVH_MAX_DEPTH + 2];
+    unsigned int size = 0, i;
+
+    result->clear();
+
+    if (this->nodes.empty())
+      return;
+
+    for (i = 0; i < 4; i++)
+      inside = point_3D(inside.x + directions[i].x,inside.y + directions[i].y,inside.z + directions[i].z);
+
+    for (i = 0; i < 4; i++)   // the side planes of the pyramid, normals pointing inside
+      {
+        normals[i] = directions[i].cross_product(directions[(i + 1) % 4]);
+
+        if (normals[i].dot_product(inside) < 0)
+          normals[i] = point_3D(-normals[i].x,-normals[i].y,-normals[i].z);
+      }
+
+    stack[size++] = 0;
+
+    while (size > 0)
+      {
+        bvh_node *node = &this->nodes[stack[--size]];
+        bool outside = false;
+
+        point_3D from = node->box_min - origin;
+        point_3D to = node->box_max - origin;
+
+        for (i = 0; i < 4 && !outside; i++)
+          {
+            // the box corner farthest inside the plane
+            point_3D corner(normals[i].x >= 0 ? to.x : from.x,normals[i].y >= 0 ? to.y : from.y,
+              normals[i].z >= 0 ? to.z : from.z);
+            double tolerance = 1e-9 * (fabs(normals[i].x * corner.x) + fabs(normals[i].y * corner.y) +
+              fabs(normals[i].z * corner.z));
+
+            outside = normals[i].dot_product(corner) < -tolerance;
+          }
+
+        if (outside)
+          continue;
+
+        if (node->count != 0)
+          {
+            for (i = node->first; i < node->first + node->count; i++)
+              result->push_back(this->order[i]);
+          }
+        else
+          {
+            stack[size++] = node->first;
+            stack[size++] = (node - this->nodes.data()) + 1;
+          }
+      }
+
+    sort(result->begin(),result->end());
+  }
+
+// Metody ray_packet
+
+ray_packet::ray_packet(point_3D origin, point_3D direction)
+  {
+    unsigned int j;
+
+    this->origin = origin;
+    this->count = 1;
+
+    for (j = 0; j < RAY_PACKET_SIZE; j++)
+      {
+        this->direction_x[j] = direction.x;
+        this->direction_y[j] = direction.y;
+        this->direction_z[j] = direction.z;
+      }
+  }
+
+void ray_packet::add(point_3D direction)
+  {
+    this->direction_x[this->count] = direction.x;
+    this->direction_y[this->count] = direction.y;
+    this->direction_z[this->count] = direction.z;
+    this->count++;
+  }
+
+void add_ray(vector<ray_packet> *packets, point_3D origin, point_3D direction)
+  {
+    if (packets->empty() || packets->back().count == RAY_PACKET_SIZE)
+      packets->push_back(ray_packet(origin,direction));
+    else
+      packets->back().add(direction);
+  }
+
+/*
+ Each triangle is intersected with all the packets before the next one,
+ the packets are independent so the out of order execution overlaps
+ them. The bodies are inlined into a function for each instruction set,
+ the compiler vectorizes the packet operations for each.
+ */
+
+static inline __attribute__((always_inline)) void closest_triangle_hits_body(vector<prepared_triangle> *triangles,
+  unsigned int *candidates, unsigned int candidate_count, ray_packet *packets, unsigned int count,
+  packet_hits *hits)
+  {
+    unsigned int i, j, k;
+
+    if (count == 0)
+      return;
+
+    for (i = 0; i < count; i++)
+      for (j = 0; j < RAY_PACKET_SIZE; j++)
+        {
+          hits[i].hit[j] = -1;
+          hits[i].t[j] = HUGE_VAL;
+        }
+
+    for (k = 0; k < candidate_count; k++)
+      {
+        packet_triangle triangle(&(*triangles)[candidates[k]],packets[0].origin);   // the same for all the packets
+
+        for (i = 0; i < count; i++)
+          packets[i].intersect_triangle(&triangle,candidates[k],&hits[i]);
+      }
+  }
+
+static inline __attribute__((always_inline)) void sphere_hits_body(sphere_3D sphere, ray_packet *packets,
+  unsigned int count, unsigned char *hit)
+  {
+    for (unsigned int i = 0; i < count; i++)
+      packets[i].intersect_sphere(sphere,hit + i * RAY_PACKET_SIZE);
+  }
+
+static void closest_triangle_hits_generic(vector<prepared_triangle> *triangles, unsigned int *candidates,
+  unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits)
+  {
+    closest_triangle_hits_body(triangles,candidates,candidate_count,packets,count,hits);
+  }
+
+static void sphere_hits_generic(sphere_3D sphere, ray_packet *packets, unsigned int count,
+  unsigned char *hit)
+  {
+    sphere_hits_body(sphere,packets,count,hit);
+  }
+
+#ifdef RAYTRACING_X86
+
+static __attribute__((target("avx2"))) void closest_triangle_hits_avx2(vector<prepared_triangle> *triangles,
+  unsigned int *candidates, unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits)
+  {
+    closest_triangle_hits_body(triangles,candidates,candidate_count,packets,count,hits);
+  }
+
+static __attribute__((target("avx512f"))) void closest_triangle_hits_avx512(vector<prepared_triangle> *triangles,
+  unsigned int *candidates, unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits)
+  {
+    closest_triangle_hits_body(triangles,candidates,candidate_count,packets,count,hits);
+  }
+
+static __attribute__((target("avx2"))) void sphere_hits_avx2(sphere_3D sphere, ray_packet *packets,
+  unsigned int count, unsigned char *hit)
+  {
+    sphere_hits_body(sphere,packets,count,hit);
+  }
+
+static __attribute__((target("avx512f"))) void sphere_hits_avx512(sphere_3D sphere, ray_packet *packets,
+  unsigned int count, unsigned char *hit)
+  {
+    sphere_hits_body(sphere,packets,count,hit);
+  }
+
+#endif
+
+static void (*closest_triangle_hits_kernel)(vector<prepared_triangle> *triangles, unsigned int *candidates,
+  unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits) =
+  closest_triangle_hits_generic;
+
+static void (*sphere_hits_kernel)(sphere_3D sphere, ray_packet *packets, unsigned int count,
+  unsigned char *hit) = sphere_hits_generic;
+
+void raytracing_dispatch(simd_level level)
+  {
+    simd_level selected = SIMD_GENERIC;
+
+    closest_triangle_hits_kernel = closest_triangle_hits_generic;
+    sphere_hits_kernel = sphere_hits_generic;
+
+#ifdef RAYTRACING_X86
+    if (level >= SIMD_AVX512)
+      {
+        closest_triangle_hits_kernel = closest_triangle_hits_avx512;
+        sphere_hits_kernel = sphere_hits_avx512;
+        selected = SIMD_AVX512;
+      }
+    else if (level >= SIMD_AVX2)
+      {
+        closest_triangle_hits_kernel = closest_triangle_hits_avx2;
+        sphere_hits_kernel = sphere_hits_avx2;
+        selected = SIMD_AVX2;
+      }
+#endif
+
+    dispatch_record("closest_triangle_hits",selected);
+    dispatch_record("sphere_hits",selected);
+  }
+
+void closest_triangle_hits(vector<prepared_triangle> *triangles, unsigned int *candidates,
+  unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits)
+  {
+    closest_triangle_hits_kernel(triangles,candidates,candidate_count,packets,count,hits);
+  }
+
+void sphere_hits(sphere_3D sphere, ray_packet *packets, unsigned int count, unsigned char *hit)
+  {
+    sphere_hits_kernel(sphere,packets,count,hit);
   }
@@ -8,56 +8,88 @@
 using namespace std;
 
 /**<
- General stuff for raytracing.
+ General stuff for raytracing. The geometry types are templates of the
+ scalar type, the typedefs (e.g. point_3D) are the double ones used for
+ the scene. Only basic_point_3D is also instantiated for float, for the
+ per pixel lighting of the float precision.
  */
 
 #define PI 3.1415926535897932384626
 
-struct point_3D        /**< point, also a vector */
+template <typename real> struct basic_point_3D   /**< point, also a vector */
   {
-    double x;
-    double y;
-    double z;
+    real x;
+    real y;
+    real z;
 
     // konstruktory
-    point_3D() : x(0.0), y(0.0), z(0.0) {};
-    point_3D(double x, double y, double z) : x(x), y(y), z(z) {};
+    basic_point_3D() : x(0.0), y(0.0), z(0.0) {};
+    basic_point_3D(real x, real y, real z) : x(x), y(y), z(z) {};
+    template <typename other> explicit basic_point_3D(basic_point_3D<other> src) : x(src.x), y(src.y), z(src.z) {}
 
-    point_3D cross_product(point_3D);
-    double dot_product(point_3D);
-    double vector_length();
+    basic_point_3D cross_product(basic_point_3D);
+    real dot_product(basic_point_3D);
+    real vector_length();
     void normalize();
-    double point_distance(point_3D);
-    double vectors_angle(point_3D);
+    real point_distance(basic_point_3D);
+    real vectors_angle(basic_point_3D);
 
-    point_3D operator - (point_3D src) { return point_3D(this->x - src.x, this->y - src.y, this->z - src.z); }
+    basic_point_3D operator - (basic_point_3D src) { return basic_point_3D(this->x - src.x, this->y - src.y, this->z - src.z); }
   };
 
-typedef struct         /**< point, also a vector */
+typedef basic_point_3D<double> point_3D;
+
+template <typename real> struct basic_sphere_3D
   {
-    point_3D center;
-    double radius;
-  } sphere_3D;
+    basic_point_3D<real> center;
+    real radius;
+  };
+
+typedef basic_sphere_3D<double> sphere_3D;
 
-struct triangle_3D
+template <typename real> struct basic_triangle_3D
   {
-    point_3D a;        /**< position coordinates */
-    point_3D b;
-    point_3D c;
+    basic_point_3D<real> a;        /**< position coordinates */
+    basic_point_3D<real> b;
+    basic_point_3D<real> c;
 
-    point_3D a_t;      /**< texturing coordinates */
-    point_3D b_t;
-    point_3D c_t;
+    basic_point_3D<real> a_t;      /**< texturing coordinates */
+    basic_point_3D<real> b_t;
+    basic_point_3D<real> c_t;
 
-    triangle_3D(point_3D a, point_3D b, point_3D c) : a(a), b(b), c(c) {}
-    triangle_3D(point_3D a, point_3D b, point_3D c,
-    point_3D a_t, point_3D b_t, point_3D c_t) : a(a), b(b), c(c), a_t(a_t), b_t(b_t), c_t(c_t) {}
+    basic_triangle_3D(basic_point_3D<real> a, basic_point_3D<real> b, basic_point_3D<real> c) : a(a), b(b), c(c) {}
+    basic_triangle_3D(basic_point_3D<real> a, basic_point_3D<real> b, basic_point_3D<real> c,
+    basic_point_3D<real> a_t, basic_point_3D<real> b_t, basic_point_3D<real> c_t) : a(a), b(b), c(c), a_t(a_t), b_t(b_t), c_t(c_t) {}
 
-    double area();
-    void get_uvw(double barycentric_a, double barycentric_b, double barycentric_c, double &u, double &v, double &w);
+    real area();
+    void get_uvw(real barycentric_a, real barycentric_b, real barycentric_c, real &u, real &v, real &w);
   };
 
-class line_3D
+typedef basic_triangle_3D<double> triangle_3D;
+
+template <typename real> struct basic_prepared_triangle  /**< triangle with what its intersections need computed in advance, at scene setup */
+  {
+    basic_triangle_3D<real> triangle;
+    basic_point_3D<real> edge1;    /**< b - a */
+    basic_point_3D<real> edge2;    /**< c - a */
+    basic_point_3D<real> normal;   /**< edge1 x edge2, as long as twice the area */
+
+    basic_prepared_triangle(basic_triangle_3D<real> triangle);
+  };
+
+typedef basic_prepared_triangle<double> prepared_triangle;
+
+void prepare_triangles(vector<triangle_3D> *triangles, vector<prepared_triangle> *prepared);
+
+  /**<
+    Makes a prepared_triangle of each triangle.
+
+    @param triangles triangles to prepare
+    @param prepared into this vector the prepared triangles will be
+           written, in the same order
+   */
+
+template <typename real> class basic_line_3D
   {
     protected:
       /* parametric line equation:
@@ -65,15 +97,15 @@ class line_3D
          y(t) = c1 + q1 * t;
          z(t) = c2 + q2 * t; */
 
-      double c0;
-      double q0;
-      double c1;
-      double q1;
-      double c2;
-      double q2;
+      real c0;
+      real q0;
+      real c1;
+      real q1;
+      real c2;
+      real q2;
 
     public:
-      line_3D(point_3D point1, point_3D point2);
+      basic_line_3D(basic_point_3D<real> point1, basic_point_3D<real> point2);
 
         /**<
           Class constructor, makes a line by two given points.
@@ -84,7 +116,7 @@ class line_3D
                  equation will give this point
           */
 
-      point_3D get_vector_to_origin();
+      basic_point_3D<real> get_vector_to_origin();
 
         /**<
           Gets a vector that's parallel with the line and points towards
@@ -94,7 +126,20 @@ class line_3D
                   points towards it's origin
          */
 
-      point_3D get_point(double t);
+      basic_point_3D<real> get_origin();
+
+        /**<
+          Gets the point of the line at t = 0.
+         */
+
+      basic_point_3D<real> get_direction();
+
+        /**<
+          Gets the direction vector of the line, not normalized, the point
+          at t = 1 is get_origin() + get_direction().
+         */
+
+      basic_point_3D<real> get_point(real t);
 
         /**<
           Gets a point of this line by given parameter value.
@@ -103,12 +148,22 @@ class line_3D
           @param point in this variable the line point will be returned
          */
 
-      bool intersects_triangle(triangle_3D triangle, double &a, double &b, double &c, double &t);
+      bool intersects_triangle(basic_triangle_3D<real> triangle, real &a, real &b, real &c, real &t);
+
+        /**<
+          Same as intersects_triangle() with a prepared_triangle, which
+          this makes on each call.
+         */
+
+      bool intersects_triangle(basic_prepared_triangle<real> *triangle, real &a, real &b, real &c, real &t);
 
         /**<
           Checks whether the line intersects given triangle plus
           computes the barycentric coordination od the intersection in
-          the triangle.
+          the triangle. This is the Moller-Trumbore test, it gives the
+          barycentric coordinates directly and needs no square roots or
+          goniometric functions. The triangle edges belong to the
+          triangle, the intersections with t < 0 don't count.
 
           @param a in this variable the first coordination of the
                  barycentric coordinations of the intersection will
@@ -124,7 +179,7 @@ class line_3D
           @return true if the triangle is intersected by the line
          */
 
-      bool intersects_sphere(sphere_3D sphere);
+      bool intersects_sphere(basic_sphere_3D<real> sphere);
 
         /**<
           Checks whether the line intersects given sphere.
@@ -135,6 +190,269 @@ class line_3D
          */
   };
 
+typedef basic_line_3D<double> line_3D;
+
+#define BVH_LEAF_SIZE 4     // the most triangles a BVH leaf holds
+#define BVH_MAX_DEPTH 48    // deeper nodes are made leaves, so the traversal stacks have a fixed size
+
+struct bvh_node        /**< node of a triangle_bvh, the nodes are stored depth first */
+  {
+    point_3D box_min;        /**< bounding box of the triangles under the node, slightly enlarged for the rounding */
+    point_3D box_max;
+    unsigned int first;      /**< for a leaf the index of its first triangle in the triangle order, for an inner node the index of its second child (the first one follows the node) */
+    unsigned int count;      /**< number of the triangles of a leaf, 0 for an inner node */
+  };
+
+class triangle_bvh     /**< triangles with a bounding volume hierarchy over them, built once when the geometry is loaded */
+  {
+    protected:
+      vector<prepared_triangle> triangles;
+      vector<bvh_node> nodes;
+      vector<unsigned int> order;    ///< triangle indices, each leaf refers to a range of them
+
+      unsigned int build_node(vector<point_3D> *centroids, unsigned int from, unsigned int to, unsigned int depth);
+      bool box_hit(bvh_node *node, point_3D origin, point_3D inverse_direction, double max_t, double &near_t);
+
+    public:
+      void build(vector<triangle_3D> *triangles);
+
+        /**<
+          Prepares the triangles and builds the hierarchy over them. The
+          nodes are split in the middle of the longest axis of their
+          triangle centroids, which is good enough for the few thousand
+          triangles of a sky.
+
+          @param triangles triangles to build the hierarchy of, their
+                 indices stay the same
+         */
+
+      vector<prepared_triangle> *get_triangles();
+
+        /**<
+          Gets the prepared triangles, in the order they were given to
+          build().
+         */
+
+      int closest_hit(line_3D *line, double &a, double &b, double &c, double &t);
+
+        /**<
+          Finds the closest triangle hit by the line, as if
+          line_3D::intersects_triangle() was called with each triangle, of
+          the hits with the same t the one with the lowest index is taken.
+
+          @param line line to intersect the triangles with
+          @param a in this variable the first barycentric coordinate of the
+                 hit will be returned
+          @param b in this variable the second barycentric coordinate of the
+                 hit will be returned
+          @param c in this variable the third barycentric coordinate of the
+                 hit will be returned
+          @param t in this variable the line parameter value of the hit
+                 will be returned
+          @return index of the triangle hit, -1 if there is none
+         */
+
+      void frustum_triangles(point_3D origin, point_3D directions[4], vector<unsigned int> *result);
+
+        /**<
+          Finds all the triangles that the lines going from a point inside
+          a pyramid may hit, e.g. the primary rays of a tile. Some of them
+          may not be hit, only their boxes are checked.
+
+          @param origin apex of the pyramid
+          @param directions directions of the pyramid edges, in order
+                 around it
+          @param result into this vector the indices of the triangles will
+                 be written, in the ascending order
+         */
+  };
+
+#define RAY_PACKET_SIZE 8   // 8 doubles fill an AVX-512 register or two AVX2 ones
+
+struct packet_hits     /**< closest triangle hit by each line of a ray packet so far */
+  {
+    long long hit[RAY_PACKET_SIZE];  /**< index of the triangle, -1 for none, as wide as the doubles so that all the lanes fit one vector */
+    double t[RAY_PACKET_SIZE];       /**< parameter value of the intersection, HUGE_VAL without one */
+    double b[RAY_PACKET_SIZE];       /**< second barycentric coordinate of the intersection */
+    double c[RAY_PACKET_SIZE];       /**< third barycentric coordinate of the intersection */
+  };
+
+struct packet_triangle  /**< prepared_triangle with the terms of its intersections that only depend on the origin of a ray packet */
+  {
+    point_3D edge1;
+    point_3D edge2;
+    point_3D to_origin;      /**< origin - a */
+    point_3D q;              /**< to_origin x edge1 */
+    double t_numerator;      /**< edge2 . q */
+
+    inline packet_triangle(prepared_triangle *triangle, point_3D origin);
+  };
+
+struct ray_packet      /**< up to RAY_PACKET_SIZE lines going from the same point, as a structure of arrays for SIMD */
+  {
+    point_3D origin;                       /**< point of all the lines at t = 0 */
+    double direction_x[RAY_PACKET_SIZE];   /**< line directions, the point of a line at t = 1 is origin + direction */
+    double direction_y[RAY_PACKET_SIZE];
+    double direction_z[RAY_PACKET_SIZE];
+    unsigned int count;                    /**< number of the lines, the other lanes repeat the first one */
+
+    ray_packet(point_3D origin, point_3D direction);
+
+      /**<
+        Makes a packet with one line, all the lanes get its direction so
+        that the unused ones compute something harmless.
+       */
+
+    void add(point_3D direction);
+
+      /**<
+        Adds a line to the packet, it must not be full.
+       */
+
+    inline void intersect_triangle(packet_triangle *triangle, int index, packet_hits *hits);
+
+      /**<
+        Does line_3D::intersects_triangle() for all the lines at once, with
+        bit-identical results. Only the lines whose hits so far are
+        farther take the intersection, so calling this for the triangles
+        in the ascending order finds the closest one hit, the lowest index
+        of the equally close ones.
+
+        @param triangle triangle to intersect, made for the origin of this
+               packet
+        @param index value written to hit for the lines that take the
+               intersection
+        @param hits hits of the lines, they are updated
+       */
+
+    inline void intersect_sphere(sphere_3D sphere, unsigned char hit[RAY_PACKET_SIZE]);
+
+      /**<
+        Does line_3D::intersects_sphere() for all the lines at once, with
+        bit-identical results.
+
+        @param sphere sphere to intersect
+        @param hit in this array 1 will be returned for the lines that
+               intersect the sphere, 0 for the others
+       */
+  };
+
+void add_ray(vector<ray_packet> *packets, point_3D origin, point_3D direction);
+
+  /**<
+    Adds a line to the last packet of a vector, or to a new packet if
+    the vector is empty or the last packet is full.
+   */
+
+/*
+ The packet operations are defined here so that they are inlined into
+ the kernels of each instruction set, the compiler vectorizes the lanes.
+ The bitwise operators evaluate the lanes without branches. The results
+ are only bit-identical to the scalar ones because the build doesn't
+ contract the multiply-adds (-ffp-contract=off), the AVX-512 kernels
+ would use FMA otherwise.
+ */
+
+inline __attribute__((always_inline)) packet_triangle::packet_triangle(prepared_triangle *triangle, point_3D origin)
+  {
+    this->edge1 = triangle->edge1;
+    this->edge2 = triangle->edge2;
+    this->to_origin = origin - triangle->triangle.a;
+    this->q = this->to_origin.cross_product(this->edge1);
+    this->t_numerator = this->edge2.dot_product(this->q);
+  }
+
+inline __attribute__((always_inline)) void ray_packet::intersect_triangle(packet_triangle *triangle, int index,
+  packet_hits *hits)
+  {
+    point_3D edge1 = triangle->edge1, edge2 = triangle->edge2, to_origin = triangle->to_origin, q = triangle->q;
+    double t_numerator = triangle->t_numerator;
+
+    #pragma omp simd
+    for (unsigned int j = 0; j < RAY_PACKET_SIZE; j++)
+      {
+        double p_x = this->direction_y[j] * edge2.z - this->direction_z[j] * edge2.y;
+        double p_y = this->direction_z[j] * edge2.x - this->direction_x[j] * edge2.z;
+        double p_z = this->direction_x[j] * edge2.y - this->direction_y[j] * edge2.x;
+        double determinant = edge1.x * p_x + edge1.y * p_y + edge1.z * p_z;
+        double inverse = 1.0 / determinant;
+
+        double line_b = (to_origin.x * p_x + to_origin.y * p_y + to_origin.z * p_z) * inverse;
+        double line_c = (this->direction_x[j] * q.x + this->direction_y[j] * q.y + this->direction_z[j] * q.z) *
+          inverse;
+        double line_t = t_numerator * inverse;
+
+        bool inside = (determinant != 0) & !(line_b < 0) & !(line_c < 0) & !(line_b + line_c > 1) &
+          !(line_t < 0);
+        bool closer = inside & (line_t < hits->t[j]);
+
+        hits->hit[j] = closer ? index : hits->hit[j];
+        hits->t[j] = closer ? line_t : hits->t[j];
+        hits->b[j] = closer ? line_b : hits->b[j];
+        hits->c[j] = closer ? line_c : hits->c[j];
+      }
+  }
+
+inline __attribute__((always_inline)) void ray_packet::intersect_sphere(sphere_3D sphere,
+  unsigned char hit[RAY_PACKET_SIZE])
+  {
+    double c0 = this->origin.x, c1 = this->origin.y, c2 = this->origin.z;
+
+    // the same for all the lines
+    double c = c0 * c0 + c1 * c1 + c2 * c2 -
+      2 * sphere.center.x * c0 - 2 * sphere.center.y * c1 - 2 * sphere.center.z * c2 +
+      sphere.center.x * sphere.center.x + sphere.center.y * sphere.center.y + sphere.center.z * sphere.center.z -
+      sphere.radius * sphere.radius;
+
+    #pragma omp simd
+    for (unsigned int j = 0; j < RAY_PACKET_SIZE; j++)
+      {
+        double q0 = this->direction_x[j], q1 = this->direction_y[j], q2 = this->direction_z[j];
+        double a = q0 * q0 + q1 * q1 + q2 * q2;
+        double b = 2 * c0 * q0 - 2 * sphere.center.x * q0 +
+          2 * c1 * q1 - 2 * sphere.center.y * q1 +
+          2 * c2 * q2 - 2 * sphere.center.z * q2;
+
+        hit[j] = b * b - 4 * a * c >= 0;
+      }
+  }
+
+void closest_triangle_hits(vector<prepared_triangle> *triangles, unsigned int *candidates,
+  unsigned int candidate_count, ray_packet *packets, unsigned int count, packet_hits *hits);
+
+  /**<
+    Intersects ray packets with some of the triangles, for each line it
+    finds the closest of them that line_3D::intersects_triangle() reports
+    a hit with (see triangle_bvh::closest_hit()), the parameter value and
+    the barycentric coordinates of the intersection, with bit-identical
+    results (benchmark_packets() checks it for each instruction set). The
+    packets are processed by the SIMD kernel selected by dispatch_init().
+
+    @param triangles triangles to intersect
+    @param candidates indices of the triangles to intersect, in the
+           ascending order, e.g. made by triangle_bvh::frustum_triangles()
+    @param candidate_count number of the candidates
+    @param packets packets to intersect, all of them must have the same
+           origin
+    @param count number of the packets
+    @param hits in this array the hits of each packet will be returned
+   */
+
+void sphere_hits(sphere_3D sphere, ray_packet *packets, unsigned int count, unsigned char *hit);
+
+  /**<
+    Intersects ray packets with a sphere, like
+    line_3D::intersects_sphere() with bit-identical results. The packets
+    are processed by the SIMD kernel selected by dispatch_init().
+
+    @param sphere sphere to intersect
+    @param packets packets to intersect
+    @param count number of the packets
+    @param hit in this array 1 will be returned for each line that
+           intersects the sphere, 0 for the others, RAY_PACKET_SIZE values
+           for each packet
+   */
+
 void make_color(unsigned char color[3],unsigned char r, unsigned char g, unsigned char b);
 double wrap(double value, double min, double max);
 double saturate(double value, double min, double max);
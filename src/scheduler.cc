@@ -0,0 +1,64 @@
+#include "scheduler.h"
+
+unsigned long long tile_scheduler::make_bounds(unsigned int from, unsigned int to)
+  {
+    return (((unsigned long long) to) << 32) | from;
+  }
+
+tile_scheduler::tile_scheduler(unsigned int tiles, unsigned int threads): ranges(threads)
+  {
+    this->threads = threads;
+    this->stolen = 0;
+
+    for (unsigned int i = 0; i < threads; i++)
+      this->ranges[i].bounds = make_bounds(tiles * (unsigned long long) i / threads,tiles * (unsigned long long) (i + 1) / threads);
+  }
+
+bool tile_scheduler::next_tile(unsigned int thread, unsigned int &tile)
+  {
+    atomic<unsigned long long> *own = &this->ranges[thread].bounds;
+    unsigned long long bounds = own->load();
+
+    /* The owner only moves the start and the thieves only the end of a
+       non-empty range, and only the owner refills its empty range, so a
+       compare and swap can't succeed on a range changed in between. */
+
+    while ((unsigned int) bounds < (unsigned int) (bounds >> 32))    // own tiles first
+      if (own->compare_exchange_weak(bounds,bounds + 1))
+        {
+          tile = (unsigned int) bounds;
+          return true;
+        }
+
+    for (unsigned int i = 1; i < this->threads; i++)                 // then the others, the neighbours first
+      {
+        atomic<unsigned long long> *victim = &this->ranges[(thread + i) % this->threads].bounds;
+        unsigned long long victim_bounds = victim->load();
+
+        while (true)
+          {
+            unsigned int from = (unsigned int) victim_bounds;
+            unsigned int to = (unsigned int) (victim_bounds >> 32);
+
+            if (from >= to)
+              break;
+
+            unsigned int middle = to - (to - from + 1) / 2;             // the back half, at least one tile
+
+            if (victim->compare_exchange_weak(victim_bounds,make_bounds(from,middle)))
+              {
+                own->store(make_bounds(middle + 1,to));
+                this->stolen++;
+                tile = middle;
+                return true;
+              }
+          }
+      }
+
+    return false;
+  }
+
+unsigned int tile_scheduler::get_stolen()
+  {
+    return this->stolen;
+  }
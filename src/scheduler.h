@@ -0,0 +1,60 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <vector>
+
+/**<
+ Work stealing distribution of the tiles of a frame among the threads of
+ an OpenMP region. Each thread starts with a contiguous range of tiles
+ (a band of the picture) and takes them from its front, a thread that
+ runs out steals the back half of the range of another one. The ranges
+ are single 64 bit atomics changed by compare and swap, so there are no
+ locks and no barriers between the tiles.
+ */
+
+using namespace std;
+
+class tile_scheduler
+  {
+    protected:
+      struct tile_range                  /**< tiles owned by one thread */
+        {
+          atomic<unsigned long long> bounds;   ///< first tile in the low 32 bits, the one after the last in the high ones
+          char padding[56];                    ///< keeps the ranges of the threads in different cache lines
+        };
+
+      vector<tile_range> ranges;
+      unsigned int threads;
+      atomic<unsigned int> stolen;
+
+      static unsigned long long make_bounds(unsigned int from, unsigned int to);
+
+    public:
+      tile_scheduler(unsigned int tiles, unsigned int threads);
+        /**<
+          Splits the tiles into equal ranges, one for each thread.
+
+          @param tiles number of the tiles, they are numbered from 0
+          @param threads number of the threads that will take them
+          */
+
+      bool next_tile(unsigned int thread, unsigned int &tile);
+        /**<
+          Gets the next tile for a thread, from its own range or stolen
+          from the others. Can be called by all the threads at once, each
+          with its own number.
+
+          @param thread number of the calling thread, less than the
+                 number given to the constructor
+          @param tile into this variable the tile will be written
+          @return true if a tile was given, false if there are no more
+          */
+
+      unsigned int get_stolen();
+        /**<
+          Gets how many times a thread stole tiles from another one.
+          */
+  };
+
+#endif
@@ -1,29 +1,631 @@
 #include "skyrenderer.h"
 #include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <omp.h>
 #include "perlin.h"
+#include "scheduler.h"
 
-void sky_renderer::draw_terrain(t_color_buffer *buffer, unsigned char r1, unsigned char g1, unsigned char b1,
-  unsigned char r2, unsigned char g2, unsigned char b2)
+struct cloud_samples    /**< cloud samples of one sky plane in one tile, evaluated at once */
   {
-    int i, j, height;
-    double x, ratio;
-    unsigned char r, g, b;
+    vector<float> x;               ///< noise coordinates
+    vector<float> y;
+    vector<float> lod;             ///< level of detail of each sample
+    vector<float> value;           ///< evaluated noise
+    vector<unsigned int> column;   ///< picture column of each sample
+    vector<unsigned int> row;      ///< picture row of each sample
+    vector<double> light;          ///< sun intensity of each sample
+
+    void clear()
+      {
+        x.clear(); y.clear(); lod.clear(); column.clear(); row.clear(); light.clear();
+      }
+  };
+
+struct tile_row        /**< sky pixels of one tile line and their primary rays */
+  {
+    vector<unsigned int> column;
+    vector<ray_packet> rays;       ///< the rays of the pixels in order, they start in the camera (origin)
+    vector<packet_hits> hits;      ///< hits of the rays with a ray traced plane
+    vector<unsigned char> sun;     ///< whether each ray hits the sun/moon
+    vector<int> hit[2];            ///< closest triangle of the lower/upper plane hit by each ray, -1 for none
+    vector<double> t[2];           ///< line parameter of each hit
+    vector<double> b[2];           ///< barycentric coordinates of each hit, only from the ray tracing
+    vector<double> c[2];
+    vector<double> u[2];           ///< texturing coordinates of each hit, only from the plane mapping
+    vector<double> v[2];
+
+    void clear()
+      {
+        column.clear(); rays.clear();
+      }
+  };
+
+struct triangle_mapping  /**< maps the pixels to the points of one sky plane triangle in one frame */
+  {
+    /*
+     The pixel rays start in the camera and their directions are linear
+     in the pixel coordinates, so the line parameter t, the barycentric
+     coordinates and u, v of the point in which a ray hits the triangle
+     plane are all ratios of linear functions of the pixel coordinates x,
+     y with a common denominator (for u, v a 3x3 homography). Each linear
+     function is kept as its coefficients of x, y and 1.
+     */
+    double denominator[3];
+    double barycentric[3][3];      ///< numerators of the barycentric coordinates
+    double u[3];                   ///< numerators of the texturing coordinates
+    double v[3];
+    double t;                      ///< numerator of t, it is constant
+  };
+
+// coefficients of x, y and 1 of gradient . direction(x, y)
+static void linear_coefficients(point_3D gradient, point_3D direction_x, point_3D direction_y, point_3D direction_0,
+  double coefficients[3])
+  {
+    coefficients[0] = gradient.dot_product(direction_x);
+    coefficients[1] = gradient.dot_product(direction_y);
+    coefficients[2] = gradient.dot_product(direction_0);
+  }
+
+static double linear_value(double coefficients[3], double x, double y)
+  {
+    return coefficients[0] * x + coefficients[1] * y + coefficients[2];
+  }
+
+#define MAPPING_TOLERANCE_FLOAT 1e-5   // how far out of the triangles (in barycentric coordinates) the float mapping hits them
+#define GLOW_RADIUS 4                  // radius of the sun/moon glow window in pixels at GLOW_REFERENCE_WIDTH
+#define GLOW_REFERENCE_WIDTH 1024      // the glow radius is scaled with the width of the rendered picture
+
+/*
+ Whether a ray hits the triangle, with the numerators of its barycentric
+ coordinates and t and their common denominator. They all have to have
+ the same sign, like the ray tracing checks the point is in front of the
+ camera and on the inner side of all the edges. The barycentric
+ coordinates may be down to -tolerance, so that the rounding doesn't
+ leave gaps between the triangles.
+ */
+template <typename real> static bool mapping_hit(real denominator, real a, real b, real c, real t, real tolerance)
+  {
+    real margin = -tolerance * denominator * denominator;
 
-    for (i = 0; i < (int) buffer->width; i++)
+    return denominator != 0 && a * denominator >= margin && b * denominator >= margin &&
+      c * denominator >= margin && t * denominator >= 0;
+  }
+
+/*
+ Maps a pixel to the plane, gives the index of the closest candidate
+ triangle hit (like the ray tracing does) or -1.
+ */
+static int map_pixel(vector<triangle_mapping> *mapping, vector<unsigned int> *candidates, double x, double y,
+  double &t, double &u, double &v)
+  {
+    int result = -1;
+
+    t = HUGE_VAL;
+
+    for (unsigned int k = 0; k < candidates->size(); k++)
       {
-        x = i / ((double) buffer->width - 1) * 2.5 + 0.3;
+        triangle_mapping *triangle = &(*mapping)[(*candidates)[k]];
+        double denominator = linear_value(triangle->denominator,x,y);
+
+        if (mapping_hit(denominator,linear_value(triangle->barycentric[0],x,y),
+          linear_value(triangle->barycentric[1],x,y),linear_value(triangle->barycentric[2],x,y),triangle->t,0.0))
+          {
+            double inverse = 1.0 / denominator;
+
+            if (triangle->t * inverse < t)
+              {
+                t = triangle->t * inverse;
+                u = linear_value(triangle->u,x,y) * inverse;
+                v = linear_value(triangle->v,x,y) * inverse;
+                result = (*candidates)[k];
+              }
+          }
+      }
+
+    return result;
+  }
+
+/*
+ Maps the sky pixels of a tile line to the plane l, the linear functions
+ are stepped along the line by additions in given precision, a hit costs
+ one division.
+ */
+template <typename real> static void map_tile_row(vector<triangle_mapping> *mapping, vector<unsigned int> *candidates,
+  unsigned int y, unsigned int x0, unsigned int x1, tile_row *row, unsigned int l, real tolerance)
+  {
+    unsigned int i, k, m, n;
 
-        height = ((sin(x) + cos(5 * x) * x / 10.0)) * buffer->height * 0.05 + buffer->height * 0.20;
+    n = row->column.size();
+    row->hit[l].assign(n,-1);
+    row->t[l].assign(n,HUGE_VAL);
+    row->u[l].resize(n);
+    row->v[l].resize(n);
 
-        for (j = height; j >= 0; j--)
+    for (k = 0; k < candidates->size(); k++)   // the triangles in order, each pixel keeps the closest one hit
+      {
+        triangle_mapping *triangle = &(*mapping)[(*candidates)[k]];
+        real denominator = linear_value(triangle->denominator,x0,y);
+        real a = linear_value(triangle->barycentric[0],x0,y);
+        real b = linear_value(triangle->barycentric[1],x0,y);
+        real c = linear_value(triangle->barycentric[2],x0,y);
+        real u = linear_value(triangle->u,x0,y);
+        real v = linear_value(triangle->v,x0,y);
+        real t = triangle->t;
+        real steps[6] = {(real) triangle->denominator[0], (real) triangle->barycentric[0][0],
+          (real) triangle->barycentric[1][0], (real) triangle->barycentric[2][0], (real) triangle->u[0],
+          (real) triangle->v[0]};
+
+        m = 0;
+
+        for (i = x0; i <= x1 && m < n; i++)
           {
-            ratio = j / ((double) height);
+            if (row->column[m] == i)   // a sky pixel
+              {
+                if (mapping_hit(denominator,a,b,c,t,tolerance))
+                  {
+                    real inverse = 1.0 / denominator;
+
+                    if (t * inverse < row->t[l][m])
+                      {
+                        row->hit[l][m] = (*candidates)[k];
+                        row->t[l][m] = t * inverse;
+                        row->u[l][m] = u * inverse;
+                        row->v[l][m] = v * inverse;
+                      }
+                  }
+
+                m++;
+              }
+
+            denominator += steps[0];
+            a += steps[1];
+            b += steps[2];
+            c += steps[3];
+            u += steps[4];
+            v += steps[5];
+          }
+      }
+  }
+
+/*
+ Dot product of the directions from a sky plane point to the sun/moon
+ and from the camera to the point, in given precision. The point is
+ where the pixel ray with given direction hits the plane at t.
+ */
+template <typename real> static double light_directness(point_3D direction, double t, point_3D sun_center)
+  {
+    basic_point_3D<real> to_camera(direction);
+    basic_point_3D<real> intersection(to_camera.x * (real) t,to_camera.y * (real) t,to_camera.z * (real) t);
+    basic_point_3D<real> to_sun = basic_point_3D<real>(sun_center) - intersection;
+
+    to_sun.normalize();
+    to_camera.normalize();
+
+    return to_sun.dot_product(to_camera);
+  }
+
+/*
+ Noise coordinate of a wrapped texturing coordinate. The noise isn't
+ periodic at exactly PERLIN_WIDTH, which u just under 1 may round to.
+ */
+static float noise_coordinate(double uv)
+  {
+    float result = uv * PERLIN_WIDTH;
+
+    return result < PERLIN_WIDTH ? result : 0;
+  }
 
-            r = interpolate_linear(r1,r2,ratio);
-            g = interpolate_linear(g1,g2,ratio);
-            b = interpolate_linear(b1,b2,ratio);
+sky_renderer::sky_renderer()
+  {
+    vector<triangle_3D> lower_plane, upper_plane;
+
+    this->octave_lod = false;
+    this->ray_traced_planes = false;
+    this->stencil_glow = false;
+    this->precision = PRECISION_DOUBLE;
+    this->terrain.width = 0;
+    this->terrain.height = 0;
+    this->geometry.width = 0;
+    this->geometry.height = 0;
+    this->geometry.ready = false;
+
+    this->setup_sky_planes(&lower_plane,&upper_plane);
+    this->set_geometry(&lower_plane,&upper_plane);
+  }
+
+void sky_renderer::set_precision(render_precision precision)
+  {
+    this->precision = precision;
+  }
+
+render_precision sky_renderer::get_precision()
+  {
+    return this->precision;
+  }
+
+/*
+ FNV-1a hash of the vertices and the texturing coordinates of the
+ triangles, continuing from given hash.
+ */
+static unsigned long hash_triangles(vector<triangle_3D> *triangles, unsigned long hash)
+  {
+    for (unsigned int i = 0; i < triangles->size(); i++)
+      {
+        triangle_3D *triangle = &(*triangles)[i];
+        point_3D points[6] = {triangle->a, triangle->b, triangle->c, triangle->a_t, triangle->b_t, triangle->c_t};
+
+        for (unsigned int j = 0; j < 6; j++)
+          {
+            double coordinates[3] = {points[j].x, points[j].y, points[j].z};
+            unsigned char *bytes = (unsigned char *) coordinates;
 
-            color_buffer_set_pixel(buffer,i,buffer->height - j - 1,r,g,b);
+            for (unsigned int k = 0; k < sizeof(coordinates); k++)
+              hash = (hash ^ bytes[k]) * 1099511628211UL;
+          }
+      }
+
+    return (hash ^ triangles->size()) * 1099511628211UL;   // so that the planes can't trade triangles
+  }
+
+void sky_renderer::set_geometry(vector<triangle_3D> *lower_plane, vector<triangle_3D> *upper_plane)
+  {
+    this->layers[0].build(lower_plane);
+    this->layers[1].build(upper_plane);
+    this->geometry_hash = hash_triangles(upper_plane,hash_triangles(lower_plane,14695981039346656037UL));
+  }
+
+triangle_bvh *sky_renderer::get_geometry(unsigned int layer)
+  {
+    return &this->layers[layer];
+  }
+
+// nacte index vrcholu nebo texturovacich souradnic (od 1, zaporny od konce), -1 pri chybe
+static int geometry_index(string text, unsigned int count)
+  {
+    char *end;
+    long index = strtol(text.c_str(),&end,10);
+
+    if (text.empty() || *end != 0 || index == 0)
+      return -1;
+
+    if (index < 0)
+      index += count + 1;
+
+    return index >= 1 && index <= (long) count ? index - 1 : -1;
+  }
+
+bool sky_renderer::load_geometry(const char *filename, unsigned int *error_line)
+  {
+    ifstream file(filename);
+    string line, keyword;
+    vector<point_3D> vertices, texturing;
+    vector<triangle_3D> planes[2];
+    unsigned int plane = 0;
+
+    *error_line = 0;
+
+    if (!file.is_open())
+      return false;
+
+    while (getline(file,line))
+      {
+        istringstream statement(line);
+
+        (*error_line)++;
+
+        if (!(statement >> keyword) || keyword[0] == '#')
+          continue;
+
+        if (keyword == "v" || keyword == "vt")
+          {
+            double x, y, z = 0;
+
+            if (!(statement >> x >> y) || (keyword == "v" && !(statement >> z)))
+              return false;
+
+            (keyword == "v" ? vertices : texturing).push_back(point_3D(x,y,keyword == "v" ? z : 0));
+          }
+        else if (keyword == "g")
+          {
+            string name;
+
+            statement >> name;
+
+            if (name == "lower")
+              plane = 0;
+            else if (name == "upper")
+              plane = 1;
+            else
+              return false;
+          }
+        else if (keyword == "f")
+          {
+            string corner;
+            vector<int> vertex, texture;
+
+            while (statement >> corner)   // v, v/vt, v/vt/vn or v//vn
+              {
+                size_t slash = corner.find('/');
+
+                vertex.push_back(geometry_index(corner.substr(0,slash),vertices.size()));
+
+                if (slash == string::npos || slash + 1 == corner.size() || corner[slash + 1] == '/')
+                  texture.push_back(-2);   // no texturing coordinates, they are zero
+                else
+                  texture.push_back(geometry_index(corner.substr(slash + 1,corner.find('/',slash + 1) - slash - 1),
+                    texturing.size()));
+
+                if (vertex.back() < 0 || texture.back() == -1)
+                  return false;
+              }
+
+            if (vertex.size() < 3)
+              return false;
+
+            for (unsigned int i = 2; i < vertex.size(); i++)
+              {
+                unsigned int corners[3] = {0, i - 1, i};
+                point_3D t[3];
+
+                for (unsigned int k = 0; k < 3; k++)
+                  if (texture[corners[k]] >= 0)
+                    t[k] = texturing[texture[corners[k]]];
+
+                planes[plane].push_back(triangle_3D(vertices[vertex[0]],vertices[vertex[i - 1]],vertices[vertex[i]],
+                  t[0],t[1],t[2]));
+              }
+          }
+      }
+
+    this->set_geometry(&planes[0],&planes[1]);
+    return true;
+  }
+
+void sky_renderer::set_octave_lod(bool enabled)
+  {
+    this->octave_lod = enabled;
+  }
+
+void sky_renderer::set_ray_traced_planes(bool enabled)
+  {
+    this->ray_traced_planes = enabled;
+  }
+
+void sky_renderer::set_stencil_glow(bool enabled)
+  {
+    this->stencil_glow = enabled;
+  }
+
+void sky_renderer::update_terrain_mask(unsigned int width, unsigned int height)
+  {
+    unsigned int i, j;
+    double x;
+
+    if (this->terrain.width == width && this->terrain.height == height)
+      return;
+
+    this->terrain.width = width;
+    this->terrain.height = height;
+    this->terrain.terrain_height.resize(width);
+    this->terrain.sky_rows.resize(width);
+    this->terrain.row_spans.resize(height + 1);
+    this->terrain.spans.clear();
+
+    for (i = 0; i < width; i++)
+      {
+        x = i / ((double) width - 1) * 2.5 + 0.3;
+
+        this->terrain.terrain_height[i] = ((sin(x) + cos(5 * x) * x / 10.0)) * height * 0.05 + height * 0.20;
+        this->terrain.sky_rows[i] = saturate_int(((int) height) - 1 - this->terrain.terrain_height[i],0,height);
+      }
+
+    for (j = 0; j < height; j++)
+      {
+        this->terrain.row_spans[j] = this->terrain.spans.size();
+
+        for (i = 0; i < width; i++)
+          if (this->terrain.sky_rows[i] > j && (i == 0 || this->terrain.sky_rows[i - 1] <= j))
+            this->terrain.spans.push_back(i);                         // sky span starts
+          else if (this->terrain.sky_rows[i] <= j && i != 0 && this->terrain.sky_rows[i - 1] > j)
+            this->terrain.spans.push_back(i);                         // and ends
+
+        if (this->terrain.spans.size() % 2)
+          this->terrain.spans.push_back(width);
+      }
+
+    this->terrain.row_spans[height] = this->terrain.spans.size();
+  }
+
+bool sky_renderer::prepare_geometry_cache(unsigned int width, unsigned int height)
+  {
+    geometry_cache *cache = &this->geometry;
+    bool float_planes = this->precision == PRECISION_FLOAT && !this->ray_traced_planes;
+    unsigned long key = this->geometry_hash ^ (this->octave_lod ? 1 : 0) ^ (this->ray_traced_planes ? 2 : 0) ^
+      (float_planes ? 4 : 0);
+    unsigned int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int i, j, k, l, pixels;
+
+    if (cache->width == width && cache->height == height && cache->key == key)
+      return true;
+
+    cache->width = 0;
+    cache->height = 0;
+    cache->ready = false;
+    cache->tile_pixels.resize(tiles_x * tiles_y + 1);
+
+    pixels = 0;
+
+    for (i = 0; i < tiles_x * tiles_y; i++)   // the sky pixels of each tile by the terrain mask
+      {
+        unsigned int x0 = (i % tiles_x) * TILE_SIZE;
+        unsigned int y0 = (i / tiles_x) * TILE_SIZE;
+        unsigned int x1 = min(x0 + TILE_SIZE,width);
+        unsigned int y1 = min(y0 + TILE_SIZE,height);
+
+        cache->tile_pixels[i] = pixels;
+
+        for (j = y0; j < y1; j++)
+          for (k = this->terrain.row_spans[j]; k < this->terrain.row_spans[j + 1]; k += 2)
+            if (this->terrain.spans[k] < x1 && this->terrain.spans[k + 1] > x0)
+              pixels += min(this->terrain.spans[k + 1],x1) - max(this->terrain.spans[k],x0);
+      }
+
+    cache->tile_pixels[tiles_x * tiles_y] = pixels;
+
+    size_t bytes = 2 * (size_t) pixels * (3 * (float_planes ? sizeof(float) : sizeof(double)) +
+      (this->octave_lod ? sizeof(float) : 0));
+
+    for (l = 0; l < 2; l++)
+      {
+        cache->candidates[l].assign(bytes <= GEOMETRY_CACHE_LIMIT ? tiles_x * tiles_y : 0,vector<unsigned int>());
+        cache->bounds[l].resize(bytes <= GEOMETRY_CACHE_LIMIT ? tiles_x * tiles_y : 0);
+
+        // only the planes of the precision are kept, the other ones are freed
+
+        cached_plane<double> empty;
+        cached_plane<float> empty_float;
+
+        swap(cache->planes[l],empty);
+        swap(cache->planes_float[l],empty_float);
+
+        if (bytes > GEOMETRY_CACHE_LIMIT)
+          continue;
+
+        if (float_planes)
+          cache->planes_float[l].resize(pixels,this->octave_lod);
+        else
+          cache->planes[l].resize(pixels,this->octave_lod);
+      }
+
+    if (bytes > GEOMETRY_CACHE_LIMIT)
+      return false;
+
+    cache->width = width;
+    cache->height = height;
+    cache->key = key;
+
+    return true;
+  }
+
+template <typename real> void sky_renderer::trace_tile(vector<triangle_mapping> *mappings,
+  vector<unsigned int> *candidates[2], bool trace[2], unsigned int width, unsigned int height, unsigned int x0,
+  unsigned int y0, unsigned int x1, unsigned int y1, tile_row *row, cached_plane<real> *planes[2], unsigned int first)
+  {
+    unsigned int i, j, k, l, m;
+    double u, v, w;
+
+    for (j = y0; j <= y1; j++)     // for each tile line
+      {
+        row->clear();
+
+        for (k = this->terrain.row_spans[j]; k < this->terrain.row_spans[j + 1]; k += 2)   // the sky pixels of the line
+          for (i = max(this->terrain.spans[k],x0); i < min(this->terrain.spans[k + 1],x1 + 1); i++)
+            {
+              row->column.push_back(i);
+
+              if (this->ray_traced_planes)
+                add_ray(&row->rays,point_3D(),pixel_ray(i,j,width,height).get_point(1.0));
+            }
+
+        for (l = 0; l < 2; l++)   // intersect the sky planes with all the rays of the line at once
+          {
+            vector<prepared_triangle> *plane = this->layers[l].get_triangles();
+
+            if (!trace[l])
+              continue;
+
+            if (!this->ray_traced_planes)
+              map_tile_row<real>(&mappings[l],candidates[l],j,x0,x1,row,l,
+                sizeof(real) == sizeof(float) ? MAPPING_TOLERANCE_FLOAT : 0.0);
+            else
+              {
+                row->hits.resize(row->rays.size());
+                closest_triangle_hits(plane,candidates[l]->data(),candidates[l]->size(),row->rays.data(),
+                  row->rays.size(),row->hits.data());
+
+                row->hit[l].resize(row->column.size());
+                row->t[l].resize(row->column.size());
+                row->u[l].resize(row->column.size());
+                row->v[l].resize(row->column.size());
+
+                for (m = 0; m < row->column.size(); m++)
+                  {
+                    packet_hits *hits = &row->hits[m / RAY_PACKET_SIZE];
+                    double barycentric_b = hits->b[m % RAY_PACKET_SIZE];
+                    double barycentric_c = hits->c[m % RAY_PACKET_SIZE];
+
+                    row->hit[l][m] = hits->hit[m % RAY_PACKET_SIZE];
+                    row->t[l][m] = hits->t[m % RAY_PACKET_SIZE];
+
+                    if (row->hit[l][m] >= 0)
+                      {
+                        (*plane)[row->hit[l][m]].triangle.get_uvw(1 - barycentric_b - barycentric_c,barycentric_b,
+                          barycentric_c,u,v,w);
+                        row->u[l][m] = u;
+                        row->v[l][m] = v;
+                      }
+                  }
+              }
+
+            for (m = 0; m < row->column.size(); m++)
+              {
+                unsigned int n = first + m;
+
+                if (row->hit[l][m] < 0)
+                  {
+                    planes[l]->t[n] = -1;
+                    continue;
+                  }
+
+                planes[l]->t[n] = row->t[l][m];
+                planes[l]->u[n] = row->u[l][m];
+                planes[l]->v[n] = row->v[l][m];
+
+                if (this->octave_lod)
+                  {
+                    line_3D line = pixel_ray(row->column[m],j,width,height);
+                    planes[l]->lod[n] = pixel_lod(&(*plane)[row->hit[l][m]],&line,row->t[l][m],width);
+                  }
+              }
+          }
+
+        first += row->column.size();
+      }
+  }
+
+void sky_renderer::draw_terrain(t_color_buffer *buffer, unsigned char r1, unsigned char g1, unsigned char b1,
+  unsigned char r2, unsigned char g2, unsigned char b2, unsigned int x0, unsigned int y0, unsigned int x1,
+  unsigned int y1)
+  {
+    terrain_mask *mask = &this->terrain;
+
+    for (unsigned int j = y0; j <= y1; j++)
+      {
+        unsigned char *line = buffer->data + 4 * j * buffer->width;
+        double row = buffer->height - j - 1;                          // counted from the bottom
+        unsigned int span, from, to;
+
+        for (span = mask->row_spans[j]; span <= mask->row_spans[j + 1]; span += 2)
+          {
+            // the terrain goes from the end of the previous sky span to the start of this one
+
+            from = max(span == mask->row_spans[j] ? 0 : mask->spans[span - 1],x0);
+            to = min(span == mask->row_spans[j + 1] ? buffer->width : mask->spans[span],x1 + 1);
+
+            #pragma omp simd
+            for (unsigned int i = from; i < to; i++)
+              {
+                double ratio = mask->terrain_height[i] == 0 ? 0 : row / mask->terrain_height[i];
+
+                line[4 * i] = ratio * (r2 - r1) + r1;                  // like interpolate_linear()
+                line[4 * i + 1] = ratio * (g2 - g1) + g1;
+                line[4 * i + 2] = ratio * (b2 - b1) + b1;
+                line[4 * i + 3] = 0xff;
+              }
           }
       }
   }
@@ -131,17 +733,78 @@ void sky_renderer::get_sun_moon_attributes(double time_of_day, sphere_3D &sphere
        }
    }
 
+bool sky_renderer::sphere_rectangle(sphere_3D sphere, unsigned int width, unsigned int height,
+  unsigned int &x0, unsigned int &y0, unsigned int &x1, unsigned int &y1)
+  {
+    double aspect_ratio = height / ((double) width);
+    double center[2] = {sphere.center.x, sphere.center.z};
+    double from[2], to[2];
+    unsigned int size[2] = {width, height};
+    unsigned int i;
+
+    x0 = 0;
+    y0 = 0;
+    x1 = width - 1;
+    y1 = height - 1;
+
+    if (sphere.center.y <= sphere.radius)   // (partly) behind the camera, the projection may be unbounded
+      return true;
+
+    for (i = 0; i < 2; i++)
+      {
+        /* The planes through the camera containing the other picture axis
+           that touch the sphere bound it along this one, in the plane of
+           this axis and y they are the tangents from the camera to a circle.
+           The sphere is in front of the camera so the tangents are too. */
+
+        double distance = sqrt(center[i] * center[i] + sphere.center.y * sphere.center.y);
+        double angle = atan2(sphere.center.y,center[i]);
+        double spread = asin(sphere.radius / distance);
+
+        // the tangents at the projection plane, 0.4 is focal distance
+        from[i] = 0.4 / tan(angle + spread);
+        to[i] = 0.4 / tan(angle - spread);
+
+        if (i == 1)
+          {
+            from[i] /= aspect_ratio;
+            to[i] /= aspect_ratio;
+          }
+
+        // to pixels, with a pixel to spare for the rounding of the exact test
+        from[i] = floor((from[i] + 0.5) * size[i]) - 1;
+        to[i] = ceil((to[i] + 0.5) * size[i]) + 1;
+
+        if (to[i] < 0 || from[i] > size[i] - 1)
+          return false;
+
+        from[i] = max(from[i],0.0);
+        to[i] = min(to[i],size[i] - 1.0);
+      }
+
+    x0 = from[0];
+    y0 = from[1];
+    x1 = to[0];
+    y1 = to[1];
+
+    return true;
+  }
+
 void sky_renderer::draw_stars(t_color_buffer *buffer, unsigned int number_of_stars)
   {
     unsigned int i,j,x,y;
     unsigned char r,g,b;
 
-    srand(10);
-
     for (j = 0; j < buffer->height; j++)
       for (i = 0; i < buffer->width; i++)
         color_buffer_set_pixel(buffer,i,j,0,0,0);
 
+    // rand() has one state for the whole program, the frames rendered at once take turns so that each gets the same stars
+
+    #pragma omp critical(stars)
+    {
+    srand(10);
+
     for (i = 0; i < number_of_stars; i++)
       {
         x = rand() % buffer->width;
@@ -160,6 +823,7 @@ void sky_renderer::draw_stars(t_color_buffer *buffer, unsigned int number_of_sta
             color_buffer_set_pixel(buffer,x,y + 1,r,g,b);
           }
       }
+    }
   }
 
 void sky_renderer::setup_sky_planes(vector<triangle_3D> *lower_plane, vector<triangle_3D> *upper_plane)
@@ -224,62 +888,61 @@ double sky_renderer::get_sun_intensity(double light_directness, double day_time)
     return saturate(intensity - 0.2,0,1) * 0.4 * saturate(light_directness,0,1) + 0.2;
   }
 
-void sky_renderer::fast_blur(t_color_buffer *buffer)
+void sky_renderer::add_sun_glow(t_color_buffer *buffer, sphere_3D sphere, unsigned int radius, unsigned int y,
+  unsigned int x0, unsigned int x1, double intensity)
   {
-    #define WINDOW_SIZE 9
-
-    unsigned int i,j,k,l,x,y;
-    unsigned char r,g,b;
-    bool color1, color2;
-    int window[WINDOW_SIZE][WINDOW_SIZE];
-    int width_minus_one, height_minus_one;
-    int sum, value;
-    t_color_buffer helper_buffer;
-
-    width_minus_one = buffer->width - 1;
-    height_minus_one = buffer->height - 1;
-
-    color_buffer_copy(buffer,&helper_buffer);
-
-    for (j = 0; j < buffer->height; j++)
-      #pragma omp for
-      for (i = 0; i < buffer->width; i++)
-        {
-          color1 = false;
-          color2 = false;
-
-          for (k = 0; k < WINDOW_SIZE; k++)
-            for (l = 0; l < WINDOW_SIZE; l++)
-              {
-                x = saturate_int(i + k - WINDOW_SIZE / 2,0,width_minus_one);
-                y = saturate_int(j + l - WINDOW_SIZE / 2,0,height_minus_one);
-
-                color_buffer_get_pixel(&helper_buffer,x,y,&r,&g,&b);
+    double aspect_ratio = buffer->height / ((double) buffer->width);
+    unsigned int i, k;
+    unsigned int window = 2 * radius + 1;
+    double square_from = y - radius - 0.5;                      // vertical extent of the pixel squares of the line
+    double square_to = y + radius + 0.5;
+    vector<double> covered(x1 - x0 + window - 1);               // how much of each column of the squares the sun/moon covers
+
+    /* The rays of a pixel column (X, 0.4, Z) hit the sphere where
+       (c . p)^2 - (|c|^2 - r^2)|p|^2 >= 0, which is quadratic in Z with a
+       negative leading coefficient for a sphere in front of the camera,
+       so the column is covered between its roots. */
+
+    double k_coefficient = sphere.center.x * sphere.center.x + sphere.center.y * sphere.center.y +
+      sphere.center.z * sphere.center.z - sphere.radius * sphere.radius;
+
+    for (i = 0; i < covered.size(); i++)
+      {
+        double x = ((int) (x0 + i)) - ((int) radius);
+        double column_x = x / buffer->width - 0.5;
+        double dot = sphere.center.x * column_x + 0.4 * sphere.center.y;   // c . p without the Z part
+        double a = sphere.center.z * sphere.center.z - k_coefficient;
+        double b = dot * sphere.center.z;
+        double c = dot * dot - k_coefficient * (column_x * column_x + 0.4 * 0.4);
+        double discriminant = b * b - a * c;
 
-                if (r == 0)
-                  color1 = true;
+        covered[i] = 0;
 
-                if (r == 0)
-                  color2 = true;
+        if (discriminant <= 0)
+          continue;
 
-                window[k][l] = r;
-              }
+        discriminant = sqrt(discriminant);
 
-          if (color1 && color2)  // blur only if needed
-            {
-              sum = 0;
+        // the roots at the projection plane to pixels, a < 0 swaps them
+        double from = ((-b + discriminant) / a / aspect_ratio + 0.5) * buffer->height;
+        double to = ((-b - discriminant) / a / aspect_ratio + 0.5) * buffer->height;
 
-              for (k = 0; k < WINDOW_SIZE; k++)
-                for (l = 0; l < WINDOW_SIZE; l++)
-                  sum += window[k][l];
+        covered[i] = max(0.0,min(to,square_to) - max(from,square_from));
+      }
 
-              value = sum / (WINDOW_SIZE * WINDOW_SIZE);
+    for (i = x0; i < x1; i++)
+      {
+        double sum = 0;
 
-              color_buffer_set_pixel(buffer,i,j,value,value,value);
-            }
-        }
+        for (k = 0; k < window; k++)
+          sum += covered[i - x0 + k];
 
-    color_buffer_destroy(&helper_buffer);
+        if (sum > 0)
+          {
+            unsigned char value = 255 * sum / (window * window) * intensity;
+            color_buffer_add_pixel(buffer,i,y,value,value,value);
+          }
+      }
   }
 
 void sky_renderer::cloud_intensity_to_color(double intensity, double threshold, double cloud_density, unsigned char color[3])
@@ -298,24 +961,301 @@ void sky_renderer::cloud_intensity_to_color(double intensity, double threshold,
       }
   }
 
+line_3D sky_renderer::pixel_ray(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+  {
+    double aspect_ratio = height / ((double) width);
+
+    // point at the projection plane, 0.4 is focal distance
+    point_3D p2(((x / ((double) width)) - 0.5),0.4,((y / ((double) height)) - 0.5) * aspect_ratio);
+
+    return line_3D(point_3D(),p2);
+  }
+
+void sky_renderer::setup_plane_mapping(vector<prepared_triangle> *plane, unsigned int width, unsigned int height,
+  vector<triangle_mapping> *mapping)
+  {
+    double aspect_ratio = height / ((double) width);
+    unsigned int i, k;
+
+    // the pixel_ray() directions (the points at t = 1) as a linear function
+    // of the pixel coordinates
+    point_3D direction_x(1.0 / width,0.0,0.0);
+    point_3D direction_y(0.0,0.0,aspect_ratio / height);
+    point_3D direction_0(-0.5,0.4,-0.5 * aspect_ratio);
+
+    mapping->resize(plane->size());
+
+    for (k = 0; k < plane->size(); k++)
+      {
+        triangle_3D *triangle = &(*plane)[k].triangle;
+        triangle_mapping *result = &(*mapping)[k];
+        point_3D vertices[3] = {triangle->a, triangle->b, triangle->c};
+        point_3D normal = (*plane)[k].normal;
+        double normal_length2 = normal.dot_product(normal);
+        double plane_distance = normal.dot_product(triangle->a);   // the hit is at t = plane_distance / (normal . direction)
+
+        linear_coefficients(normal,direction_x,direction_y,direction_0,result->denominator);
+        result->t = plane_distance;
+
+        /*
+         The barycentric coordinate of vertex a in point p is
+         normal . ((b - p) x (c - p)) / |normal|^2, with p = t * direction
+         this is (normal . (b x c) * normal + plane_distance * ((b - c) x
+         normal)) . direction over |normal|^2 * (normal . direction).
+         */
+
+        for (i = 0; i < 3; i++)
+          {
+            point_3D b = vertices[(i + 1) % 3];
+            point_3D c = vertices[(i + 2) % 3];
+            double area = normal.dot_product(b.cross_product(c));
+            point_3D edge = (b - c).cross_product(normal);
+            point_3D gradient((area * normal.x + plane_distance * edge.x) / normal_length2,
+              (area * normal.y + plane_distance * edge.y) / normal_length2,
+              (area * normal.z + plane_distance * edge.z) / normal_length2);
+
+            linear_coefficients(gradient,direction_x,direction_y,direction_0,result->barycentric[i]);
+          }
+
+        for (i = 0; i < 3; i++)   // u and v interpolate the vertex coordinates by the barycentric ones
+          {
+            result->u[i] = result->barycentric[0][i] * triangle->a_t.x + result->barycentric[1][i] * triangle->b_t.x +
+              result->barycentric[2][i] * triangle->c_t.x;
+            result->v[i] = result->barycentric[0][i] * triangle->a_t.y + result->barycentric[1][i] * triangle->b_t.y +
+              result->barycentric[2][i] * triangle->c_t.y;
+          }
+      }
+  }
+
+float sky_renderer::pixel_lod(prepared_triangle *triangle, line_3D *line, double t, unsigned int width)
+  {
+    if (!this->octave_lod)
+      return HUGE_VALF;
+
+    point_3D normal = triangle->normal;
+    point_3D normal_t = (triangle->triangle.b_t - triangle->triangle.a_t).cross_product(triangle->triangle.c_t -
+      triangle->triangle.a_t);
+    point_3D direction = line->get_point(1.0);
+
+    // texels per world unit on the plane
+    double texel_density = sqrt(normal_t.vector_length() / normal.vector_length()) * PERLIN_WIDTH;
+
+    // the pixel is 1 / width wide at the projection plane point the ray
+    // goes through at t = 1, so it's about t / width wide at the hit,
+    // stretched on a sloping plane
+    double footprint = t / width;
+    normal.normalize();
+    direction.normalize();
+    footprint /= max(fabs(normal.dot_product(direction)),0.05);
+
+    return log2(PERLIN_WIDTH / (2.0 * max(footprint * texel_density,1e-6)));
+  }
+
+void sky_renderer::tile_triangles(unsigned int layer, unsigned int width, unsigned int height, unsigned int x0,
+  unsigned int y0, unsigned int x1, unsigned int y1, vector<unsigned int> *candidates)
+  {
+    // the rays of the tile pixels are in the pyramid of the corner pixel rays
+    point_3D directions[4] = {pixel_ray(x0,y0,width,height).get_direction(),
+      pixel_ray(x1,y0,width,height).get_direction(),pixel_ray(x1,y1,width,height).get_direction(),
+      pixel_ray(x0,y1,width,height).get_direction()};
+
+    this->layers[layer].frustum_triangles(point_3D(),directions,candidates);
+  }
+
+void sky_renderer::tile_bounds(unsigned int layer, vector<unsigned int> *candidates,
+  vector<triangle_mapping> *mapping, unsigned int width, unsigned int height, unsigned int x0, unsigned int y0,
+  unsigned int x1, unsigned int y1, tile_uv_bounds *bounds)
+  {
+    vector<prepared_triangle> *plane = this->layers[layer].get_triangles();
+    double aspect_ratio = height / ((double) width);
+    unsigned int i, x, y, perimeter;
+    int k;
+    double u, v, w, t, barycentric_a, barycentric_b, barycentric_c;
+    double *uv_min = bounds->uv_min, *uv_max = bounds->uv_max, previous[2] = {0, 0};
+
+    uv_min[0] = HUGE_VAL; uv_min[1] = HUGE_VAL;
+    uv_max[0] = -HUGE_VAL; uv_max[1] = -HUGE_VAL;
+    bounds->uv_step = 0;
+    bounds->min_lod = HUGE_VALF;
+    bounds->covered = false;
+
+    perimeter = x1 > x0 && y1 > y0 ? 2 * (x1 - x0) + 2 * (y1 - y0) : (x1 - x0) + (y1 - y0) + 1;
+
+    for (i = 0; i < perimeter; i++)   // go around the tile border, clockwise from the top left pixel
+      {
+        if (i < x1 - x0)
+          { x = x0 + i; y = y0; }
+        else if (i < (x1 - x0) + (y1 - y0))
+          { x = x1; y = y0 + i - (x1 - x0); }
+        else if (i < 2 * (x1 - x0) + (y1 - y0))
+          { x = x1 - (i - (x1 - x0) - (y1 - y0)); y = y1; }
+        else
+          { x = x0; y = y1 - (i - 2 * (x1 - x0) - (y1 - y0)); }
+
+        line_3D line = pixel_ray(x,y,width,height);
+
+        if (mapping != NULL)
+          k = map_pixel(mapping,candidates,x,y,t,u,v);
+        else
+          {
+            k = this->layers[layer].closest_hit(&line,barycentric_a,barycentric_b,barycentric_c,t);
+
+            if (k >= 0)
+              (*plane)[k].triangle.get_uvw(barycentric_a,barycentric_b,barycentric_c,u,v,w);
+          }
+
+        if (k < 0)   // the tile isn't covered by the plane, its inside can't be bounded
+          return;
+
+        bounds->min_lod = min(bounds->min_lod,pixel_lod(&(*plane)[k],&line,t,width));
+
+        if (i != 0)
+          bounds->uv_step = max(bounds->uv_step,max(fabs(u - previous[0]),fabs(v - previous[1])));
+
+        previous[0] = u;
+        previous[1] = v;
+        uv_min[0] = min(uv_min[0],u);
+        uv_min[1] = min(uv_min[1],v);
+        uv_max[0] = max(uv_max[0],u);
+        uv_max[1] = max(uv_max[1],v);
+      }
+
+    for (i = 0; i < candidates->size(); i++)   // the triangle vertices inside the tile
+      {
+        triangle_3D *triangle = &(*plane)[(*candidates)[i]].triangle;
+        point_3D vertices[3] = {triangle->a, triangle->b, triangle->c};
+        point_3D texturing[3] = {triangle->a_t, triangle->b_t, triangle->c_t};
+
+        for (unsigned int j = 0; j < 3; j++)
+          {
+            if (vertices[j].y <= 0)   // behind the camera
+              continue;
+
+            // the inverse of pixel_ray()
+            double vertex_x = (vertices[j].x / vertices[j].y * 0.4 + 0.5) * width;
+            double vertex_y = (vertices[j].z / vertices[j].y * 0.4 / aspect_ratio + 0.5) * height;
+
+            if (vertex_x < x0 - 1 || vertex_x > x1 + 1 || vertex_y < y0 - 1 || vertex_y > y1 + 1)
+              continue;
+
+            uv_min[0] = min(uv_min[0],texturing[j].x);
+            uv_min[1] = min(uv_min[1],texturing[j].y);
+            uv_max[0] = max(uv_max[0],texturing[j].x);
+            uv_max[1] = max(uv_max[1],texturing[j].y);
+          }
+      }
+
+    bounds->covered = true;
+  }
+
+bool sky_renderer::tile_is_clear(tile_uv_bounds *bounds, perlin_slice *slice, double uv_shift, double threshold)
+  {
+    float texels[2][2];
+
+    if (!bounds->covered)
+      return false;
+
+    // the extremes may lie between two border pixels, where the mapping
+    // bends from one triangle to the other, so widen the range by a step
+
+    for (unsigned int i = 0; i < 2; i++)
+      {
+        double from = bounds->uv_min[i] + uv_shift - 2 * bounds->uv_step - 1e-6;
+        double to = bounds->uv_max[i] + uv_shift + 2 * bounds->uv_step + 1e-6;
+
+        if (floor(from) != floor(to))   // the range wraps around, it may be anything
+          {
+            from = 0;
+            to = 1;
+          }
+        else
+          {
+            from -= floor(from);
+            to -= floor(to);
+          }
+
+        texels[i][0] = from * PERLIN_WIDTH;
+        texels[i][1] = to * PERLIN_WIDTH;
+      }
+
+    // the level of detail doesn't change much over a tile, a margin of one
+    // octave covers the inside
+    return slice->upper_bound(texels[0][0],texels[1][0],texels[0][1],texels[1][1],bounds->min_lod - 1) < threshold;
+  }
+
+size_t sky_renderer::frame_memory(unsigned int width, unsigned int height)
+  {
+    size_t pixels = width * (size_t) height;
+    size_t tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * (size_t) ((height + TILE_SIZE - 1) / TILE_SIZE);
+    size_t bytes = 4 * pixels * (this->stencil_glow ? 2 : 1);              // the stars and the stencil buffer
+    size_t planes = 2 * pixels * (3 * (this->precision == PRECISION_FLOAT && !this->ray_traced_planes ?
+      sizeof(float) : sizeof(double)) + (this->octave_lod ? sizeof(float) : 0));
+
+    bytes += 3 * sizeof(unsigned int) * (width + 2 * (size_t) height);     // the terrain mask, about
+
+    if (planes <= GEOMETRY_CACHE_LIMIT)                                    // the geometry cache, as if all the pixels were sky
+      bytes += planes + tiles * (sizeof(unsigned int) + 2 * (sizeof(vector<unsigned int>) + sizeof(tile_uv_bounds)));
+
+    return bytes;
+  }
+
+render_statistics sky_renderer::get_statistics()
+  {
+    return this->statistics;
+  }
+
 void sky_renderer::render_sky(t_color_buffer *buffer, double time_of_day, const double clouds, const double density, const double offset)
   {
 
     t_color_buffer stars, sun_stencil;
     color_buffer_init(&stars,buffer->width,buffer->height);             // buffer to which stars will be drawn
-    color_buffer_init(&sun_stencil,buffer->width,buffer->height);       // buffer to which sun stencil will be drawn
 
-    #pragma omp parallel default(none) firstprivate(time_of_day, clouds, density, offset) shared(buffer, sun_stencil, stars)
-    {
-    unsigned int i,j,k,l;
-    point_3D p1, p2, intersection, to_sun, to_camera;
-    double u, v, w, t, star_intensity, sun_intensity, aspect_ratio, barycentric_a, barycentric_b, barycentric_c;
-    unsigned char r, g, b;
-    vector<triangle_3D> sky_plane, sky_plane2;                          // triangles that make up the lower/upper sky plane
-    unsigned char background_color_from[3], background_color_to[3], sun_moon_color[3], cloud_color[3];
-    unsigned char terrain_color1[3], terrain_color2[3];
+    if (this->stencil_glow)
+      color_buffer_init(&sun_stencil,buffer->width,buffer->height);     // buffer to which sun stencil will be drawn
+
+    // the planes sample the noise at a constant w during the whole frame
+    double plane_w = wrap(time_of_day,0.0,1.0);
+    perlin_slice lower_slice(plane_w * PERLIN_WIDTH), upper_slice((1 - plane_w) * PERLIN_WIDTH);
 
-    color_buffer_clear(buffer);
+    unsigned int tiles_x = (buffer->width + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int tiles_y = (buffer->height + TILE_SIZE - 1) / TILE_SIZE;
+
+    this->statistics.tiles = tiles_x * tiles_y;
+    this->statistics.skipped_tiles[0] = 0;
+    this->statistics.skipped_tiles[1] = 0;
+
+    update_terrain_mask(buffer->width,buffer->height);
+
+    // the pixels the sun/moon may cover, its glow reaches glow_radius pixels around them, more with bigger pictures and supersampling
+
+    sphere_3D sun_moon;
+    unsigned char sun_moon_color[3];
+    unsigned int sun_x0, sun_y0, sun_x1, sun_y1;
+    unsigned int glow_x0 = 0, glow_y0 = 0, glow_x1 = 0, glow_y1 = 0;    // the last ones exclusive
+    unsigned int glow_radius = max(1,(int) round(GLOW_RADIUS * buffer->width / ((double) GLOW_REFERENCE_WIDTH)));
+
+    get_sun_moon_attributes(wrap(time_of_day,0.0,1.0),sun_moon,sun_moon_color);
+    bool sun_visible = sphere_rectangle(sun_moon,buffer->width,buffer->height,sun_x0,sun_y0,sun_x1,sun_y1);
+
+    if (sun_visible)
+      {
+        glow_x0 = sun_x0 > glow_radius ? sun_x0 - glow_radius : 0;
+        glow_y0 = sun_y0 > glow_radius ? sun_y0 - glow_radius : 0;
+        glow_x1 = min(sun_x1 + glow_radius + 1,buffer->width);
+        glow_y1 = min(sun_y1 + glow_radius + 1,buffer->height);
+      }
+
+    // the geometry of the sky pixels is the same in all the frames, it's traced in the first one and then cached
+
+    bool cached = prepare_geometry_cache(buffer->width,buffer->height);
+    bool cache_ready = cached && this->geometry.ready;
+    bool float_planes = this->precision == PRECISION_FLOAT && !this->ray_traced_planes;
+
+    // frame setup shared by all the threads, made by one thread each before the tiles start
+
+    unsigned char background_color_from[3], background_color_to[3];
+    unsigned char terrain_color1[3], terrain_color2[3];
+    vector<triangle_mapping> mappings[2];                               // pixel to plane mapping of the lower/upper plane
 
     time_of_day = wrap(time_of_day,0.0,1.0);
 
@@ -325,100 +1265,260 @@ void sky_renderer::render_sky(t_color_buffer *buffer, double time_of_day, const
     blend_colors(terrain_color1,background_color_to,0.2);                                           // slightly alter the terrain color with background color
     blend_colors(terrain_color2,background_color_from,0.4);
 
-    draw_terrain(buffer,terrain_color2[0],terrain_color2[1],terrain_color2[2],terrain_color1[0],terrain_color1[1],terrain_color1[2]);   // draw the terrain before rendering the sky
+    double star_intensity = get_star_intensity(time_of_day);
 
-    setup_sky_planes(&sky_plane,&sky_plane2);
-    star_intensity = get_star_intensity(time_of_day);
+    // each tile is rendered whole, terrain, sky, clouds and glow, by one thread, there's no barrier between the tiles
 
-    #pragma omp master
-    draw_stars(&stars,1000);
+    tile_scheduler *scheduler;                                          // made for the team the runtime really gives
 
-    aspect_ratio = buffer->height / ((double) buffer->width);
+    #pragma omp parallel default(none) firstprivate(time_of_day, clouds, density, offset, star_intensity) shared(buffer, sun_stencil, stars, \
+      lower_slice, upper_slice, tiles_x, tiles_y, sun_moon, sun_moon_color, sun_visible, sun_x0, sun_y0, sun_x1, sun_y1, glow_radius, \
+      glow_x0, glow_y0, glow_x1, glow_y1, cached, cache_ready, float_planes, background_color_from, background_color_to, terrain_color1, \
+      terrain_color2, mappings, scheduler)
+    {
+    unsigned int i,j,k,l,m;
+    double u, v, t, sun_intensity;
+    unsigned char r, g, b;
+    vector<unsigned int> candidates[2];                                 // triangles of the lower/upper plane a tile may hit
+    tile_uv_bounds bounds[2];                                           // and its texturing coordinates there
+    cached_plane<double> tile_planes[2];                                // geometry of the tile when it isn't cached
+    cached_plane<float> tile_planes_float[2];
+    unsigned char cloud_color[3];
 
-    sphere_3D sun_moon;
-    get_sun_moon_attributes(time_of_day,sun_moon,sun_moon_color);
+    #pragma omp single nowait
+      {
+        scheduler = new tile_scheduler(tiles_x * tiles_y,omp_get_num_threads());
+        this->statistics.busy_time.assign(omp_get_num_threads(),0);
+      }
 
-    for (j = 0; j < buffer->height; j++)            // for each picture line
+    #pragma omp single nowait
+    draw_stars(&stars,1000);
+
+    if (!cache_ready)
       {
-        // make the background color from gradient:
+        #pragma omp single nowait
+        setup_plane_mapping(this->layers[0].get_triangles(),buffer->width,buffer->height,&mappings[0]);
 
-        double ratio = j / ((double) buffer->height);
-        unsigned char back_r, back_g, back_b;
-        back_r = interpolate_linear(background_color_from[0],background_color_to[0],ratio);
-        back_g = interpolate_linear(background_color_from[1],background_color_to[1],ratio);
-        back_b = interpolate_linear(background_color_from[2],background_color_to[2],ratio);
+        #pragma omp single nowait
+        setup_plane_mapping(this->layers[1].get_triangles(),buffer->width,buffer->height,&mappings[1]);
+      }
 
-        #pragma omp for
-        for (i = 0; i < buffer->width; i++)        // for each picture column
-          {
-            color_buffer_get_pixel(buffer,i,j,&r,&g,&b);
+    if (!cached)
+      for (l = 0; l < 2; l++)
+        {
+          tile_planes[l].resize(TILE_SIZE * TILE_SIZE,this->octave_lod);
+          tile_planes_float[l].resize(TILE_SIZE * TILE_SIZE,this->octave_lod);
+        }
 
-            if (r != 255 && g != 255 && b != 255)  // not white (terrain) => don't render
-              continue;
+    #pragma omp barrier      // the scheduler, the stars and the mappings are ready
 
-            // point at the projection plane, 0.4 is focal distance
-            p2 = point_3D(((i / ((double) buffer->width)) - 0.5),0.4,((j / ((double) buffer->height)) - 0.5) * aspect_ratio);
+    cloud_samples samples[2];                                           // samples of the lower/upper sky plane
+    tile_row row;
+    unsigned int thread = omp_get_thread_num(), tile;
+    chrono::steady_clock::duration busy_time(0);
 
-            line_3D line(p1,p2);                                        // make the ray line
+    while (scheduler->next_tile(thread,tile))
+      {
+        chrono::steady_clock::time_point tile_start = chrono::steady_clock::now();
+        unsigned int tile_x0 = (tile % tiles_x) * TILE_SIZE;
+        unsigned int tile_y0 = (tile / tiles_x) * TILE_SIZE;
+        unsigned int tile_x1 = min(tile_x0 + TILE_SIZE,buffer->width) - 1;
+        unsigned int tile_y1 = min(tile_y0 + TILE_SIZE,buffer->height) - 1;
+        bool plane_clear[2], trace[2];
+        bool tile_sun = sun_visible && tile_x0 <= sun_x1 && tile_x1 >= sun_x0;
+        unsigned int pixel = cached ? this->geometry.tile_pixels[tile] : 0;     // index of the next sky pixel in the geometry
+        vector<unsigned int> *tile_candidates[2];
+        tile_uv_bounds *tile_bounds[2];
+        cached_plane<double> *geometry[2];
+        cached_plane<float> *geometry_float[2];
+
+        draw_terrain(buffer,terrain_color2[0],terrain_color2[1],terrain_color2[2],terrain_color1[0],terrain_color1[1],terrain_color1[2],
+          tile_x0,tile_y0,tile_x1,tile_y1);                             // the terrain under the sky
+
+        if (*max_element(this->terrain.sky_rows.begin() + tile_x0,this->terrain.sky_rows.begin() + tile_x1 + 1) > tile_y0)   // not all terrain
+          {
+            for (l = 0; l < 2; l++)   // find out whether the planes can have any clouds here
+              {
+                tile_candidates[l] = cached ? &this->geometry.candidates[l][tile] : &candidates[l];
+                tile_bounds[l] = cached ? &this->geometry.bounds[l][tile] : &bounds[l];
+                geometry[l] = cached ? &this->geometry.planes[l] : &tile_planes[l];
+                geometry_float[l] = cached ? &this->geometry.planes_float[l] : &tile_planes_float[l];
 
-            color_buffer_get_pixel(&stars,i,j,&r,&g,&b);                // stars
+                if (!cache_ready)
+                  {
+                    tile_triangles(l,buffer->width,buffer->height,tile_x0,tile_y0,tile_x1,tile_y1,tile_candidates[l]);
 
-            r *= star_intensity;
-            g *= star_intensity;
-            b *= star_intensity;
+                    if (!tile_candidates[l]->empty())
+                      this->tile_bounds(l,tile_candidates[l],this->ray_traced_planes ? NULL : &mappings[l],buffer->width,
+                        buffer->height,tile_x0,tile_y0,tile_x1,tile_y1,tile_bounds[l]);
+                  }
 
-            color_buffer_set_pixel(buffer,i,j,round_to_char(back_r + r),round_to_char(back_g + g),round_to_char(back_b + b)); // background gradient + stars
+                plane_clear[l] = tile_candidates[l]->empty() || tile_is_clear(tile_bounds[l],
+                  l == 0 ? &lower_slice : &upper_slice,offset + time_of_day * 2,clouds);
 
-            if (line.intersects_sphere(sun_moon))                       // sun/moon
-              {
-                color_buffer_set_pixel(buffer,i,j,sun_moon_color[0],sun_moon_color[1],sun_moon_color[2]);
-                color_buffer_set_pixel(&sun_stencil,i,j,0,0,0);
+                // the whole geometry goes to the cache, without it only the planes with clouds are needed
+                trace[l] = !cache_ready && !tile_candidates[l]->empty() && (cached || !plane_clear[l]);
+
+                if (plane_clear[l] && !tile_candidates[l]->empty())      // the noise bound proved it, not just no triangles
+                  {
+                    #pragma omp atomic
+                    this->statistics.skipped_tiles[l]++;
+                  }
               }
 
-            for (l = 0; l < 2; l++)   // for both sky planes
+            if (float_planes)
+              trace_tile<float>(mappings,tile_candidates,trace,buffer->width,buffer->height,tile_x0,tile_y0,tile_x1,tile_y1,
+                &row,geometry_float,pixel);
+            else
+              trace_tile<double>(mappings,tile_candidates,trace,buffer->width,buffer->height,tile_x0,tile_y0,tile_x1,tile_y1,
+                &row,geometry,pixel);
+
+            samples[0].clear();
+            samples[1].clear();
+
+            for (j = tile_y0; j <= tile_y1; j++)     // for each tile line
               {
-                vector<triangle_3D> *plane;
+                // make the background color from gradient:
+
+                double ratio = j / ((double) buffer->height);
+                unsigned char back_r, back_g, back_b;
+                back_r = interpolate_linear(background_color_from[0],background_color_to[0],ratio);
+                back_g = interpolate_linear(background_color_from[1],background_color_to[1],ratio);
+                back_b = interpolate_linear(background_color_from[2],background_color_to[2],ratio);
 
-                plane = l == 0 ? &sky_plane : &sky_plane2;              // get the pointer to plane being rendered
+                bool sun_row = tile_sun && j >= sun_y0 && j <= sun_y1;      // only the rows through the sun/moon rectangle can hit it
 
-                for (k = 0; k < plane->size(); k++)                     // for all triangles of the sky plane
-                  if (line.intersects_triangle((*plane)[k],barycentric_a,barycentric_b,barycentric_c,t))
+                row.clear();
+
+                for (k = this->terrain.row_spans[j]; k < this->terrain.row_spans[j + 1]; k += 2)   // the sky pixels of the line
+                  for (i = max(this->terrain.spans[k],tile_x0); i < min(this->terrain.spans[k + 1],tile_x1 + 1); i++)
+                    {
+                      row.column.push_back(i);
+
+                      if (sun_row)
+                        add_ray(&row.rays,point_3D(),pixel_ray(i,j,buffer->width,buffer->height).get_point(1.0));
+                    }
+
+                row.sun.resize(row.column.size() + RAY_PACKET_SIZE);
+
+                if (sun_row)   // the rays of the line are intersected in packets
+                  sphere_hits(sun_moon,row.rays.data(),row.rays.size(),row.sun.data());
+                else
+                  fill(row.sun.begin(),row.sun.end(),0);
+
+                for (m = 0; m < row.column.size(); m++, pixel++)
                   {
-                    (*plane)[k].get_uvw(barycentric_a,barycentric_b,barycentric_c,u,v,w);
+                    i = row.column[m];
 
-                    u = wrap(u + offset + time_of_day * 2,0,1);
-                    v = wrap(v + offset + time_of_day * 2,0,1);
-                    w = (l == 0 ? time_of_day : 1 - time_of_day);
+                    line_3D line = pixel_ray(i,j,buffer->width,buffer->height);    // make the ray line
 
-                    float f = saturate(perlin(u * PERLIN_WIDTH,v * PERLIN_WIDTH, w * PERLIN_WIDTH),0,1.0);
+                    color_buffer_get_pixel(&stars,i,j,&r,&g,&b);                // stars
 
-                    cloud_intensity_to_color(f,clouds,density,cloud_color);   // maps f to [r,g,b] with threshold
+                    r *= star_intensity;
+                    g *= star_intensity;
+                    b *= star_intensity;
+
+                    color_buffer_set_pixel(buffer,i,j,round_to_char(back_r + r),round_to_char(back_g + g),round_to_char(back_b + b)); // background gradient + stars
+
+                    if (row.sun[m])                                             // sun/moon
+                      {
+                        color_buffer_set_pixel(buffer,i,j,sun_moon_color[0],sun_moon_color[1],sun_moon_color[2]);
+
+                        if (this->stencil_glow)
+                          color_buffer_set_pixel(&sun_stencil,i,j,0,0,0);
+                      }
+
+                    for (l = 0; l < 2; l++)   // for both sky planes
+                      {
+                        if (plane_clear[l])                                     // clear sky would add nothing
+                          continue;
+
+                        if (float_planes)
+                          {
+                            t = geometry_float[l]->t[pixel];
+                            u = geometry_float[l]->u[pixel];
+                            v = geometry_float[l]->v[pixel];
+                          }
+                        else
+                          {
+                            t = geometry[l]->t[pixel];
+                            u = geometry[l]->u[pixel];
+                            v = geometry[l]->v[pixel];
+                          }
+
+                        if (t < 0)                                              // the plane isn't hit
+                          continue;
+
+                        u = wrap(u + offset + time_of_day * 2,0,1);
+                        v = wrap(v + offset + time_of_day * 2,0,1);
 
-                    intersection = line.get_point(t);
-                    to_sun = sun_moon.center - intersection;
-                    to_sun.normalize();
-                    to_camera = line.get_vector_to_origin();
-                    sun_intensity = get_sun_intensity(to_sun.dot_product(to_camera), time_of_day);
+                        sun_intensity = get_sun_intensity(this->precision == PRECISION_FLOAT ?
+                          light_directness<float>(line.get_direction(),t,sun_moon.center) :
+                          light_directness<double>(line.get_direction(),t,sun_moon.center),time_of_day);
 
-                    color_buffer_add_pixel(buffer,i,j,cloud_color[0] * sun_intensity,cloud_color[1] * sun_intensity,cloud_color[2] * sun_intensity);
+                        samples[l].x.push_back(noise_coordinate(u));         // the noise is evaluated later for the whole tile
+                        samples[l].y.push_back(noise_coordinate(v));
+
+                        if (this->octave_lod)
+                          samples[l].lod.push_back(float_planes ? geometry_float[l]->lod[pixel] : geometry[l]->lod[pixel]);
+
+                        samples[l].column.push_back(i);
+                        samples[l].row.push_back(j);
+                        samples[l].light.push_back(sun_intensity);
+                      }
+                  }
+              }
+
+            for (l = 0; l < 2; l++)   // lower plane first so that each pixel gets the clouds in the original order
+              {
+                cloud_samples *plane_samples = &samples[l];
+
+                plane_samples->value.resize(plane_samples->x.size());
+                // the noise under the clouds threshold is clear sky, it doesn't need to be exact
+                if (this->octave_lod)
+                  (l == 0 ? lower_slice : upper_slice).sample_batch_lod(plane_samples->x.data(),plane_samples->y.data(),plane_samples->lod.data(),clouds,plane_samples->value.data(),plane_samples->value.size());
+                else
+                  (l == 0 ? lower_slice : upper_slice).sample_batch_thresholded(plane_samples->x.data(),plane_samples->y.data(),clouds,plane_samples->value.data(),plane_samples->value.size());
+
+                for (k = 0; k < plane_samples->value.size(); k++)
+                  {
+                    float f = saturate(plane_samples->value[k],0,1.0);
+
+                    cloud_intensity_to_color(f,clouds,density,cloud_color);   // maps f to [r,g,b] with threshold
+
+                    sun_intensity = plane_samples->light[k];
+                    color_buffer_add_pixel(buffer,plane_samples->column[k],plane_samples->row[k],cloud_color[0] * sun_intensity,cloud_color[1] * sun_intensity,cloud_color[2] * sun_intensity);
                   }
               }
           }
+
+        if (!this->stencil_glow && tile_x0 < glow_x1 && tile_x1 >= glow_x0)   // the glow over the finished pixels
+          for (j = max(tile_y0,glow_y0); j < min(tile_y1 + 1,glow_y1); j++)
+            add_sun_glow(buffer,sun_moon,glow_radius,j,max(tile_x0,glow_x0),min(tile_x1 + 1,glow_x1),0.75);
+
+        busy_time += chrono::steady_clock::now() - tile_start;
       }
-    
-    fast_blur(&sun_stencil);
 
-    for (j = 0; j < buffer->height; j++)
-      #pragma omp for
-      for (i = 0; i < buffer->width; i++)
-        {
-          color_buffer_get_pixel(&sun_stencil,i,j,&r,&g,&b);
-          r = (255 - r) * 0.75;
-          color_buffer_add_pixel(buffer,i,j,r,r,r);
-        }
+    this->statistics.busy_time[thread] = chrono::duration<double>(busy_time).count();
 
     } // omp parallel end
 
-    color_buffer_destroy(&sun_stencil);
-        
+    this->statistics.stolen_tiles = scheduler->get_stolen();
+    delete scheduler;
+
+    if (cached)
+      this->geometry.ready = true;
+
+    if (this->stencil_glow)   // the stencil is white outside the glow rectangle, it would add nothing there
+      {
+        color_buffer_box_blur(&sun_stencil,glow_radius,glow_x0,glow_y0,glow_x1,glow_y1,BLUR_RUNNING_SUM);
+
+        #pragma omp parallel for
+        for (int j = glow_y0; j < (int) glow_y1; j++)
+          color_buffer_add_inverted(buffer,&sun_stencil,0.75,j,j + 1,glow_x0,glow_x1);
+
+        color_buffer_destroy(&sun_stencil);
+      }
+
+    color_buffer_destroy(&stars);
   }
@@ -3,12 +3,233 @@
 
 #include "raytracing.h"
 #include "colorbuffer.h"
+#include "perlin.h"
+
+#define TILE_SIZE 32    // the picture is rendered in tiles of TILE_SIZE x TILE_SIZE pixels
+
+#define GEOMETRY_CACHE_LIMIT (256 << 20)  // the geometry cache isn't used if it would take more bytes
+
+struct triangle_mapping;
+struct tile_row;
+
+enum render_precision     /**< scalar type of the per pixel computations */
+  {
+    PRECISION_DOUBLE,     ///< the reference
+    PRECISION_FLOAT       ///< within one level of the 8 bit colors from the reference
+  };
+
+struct render_statistics  /**< numbers about the last rendered frame */
+  {
+    unsigned int tiles;               ///< number of tiles the picture was split into
+    unsigned int skipped_tiles[2];    ///< tiles in which the lower/upper plane had no clouds for sure, not counting those it doesn't reach
+    unsigned int stolen_tiles;        ///< how many times a thread stole tiles from another one
+    vector<double> busy_time;         ///< seconds each thread of the team spent rendering its tiles
+  };
+
+struct tile_uv_bounds     /**< range of the texturing coordinates of a sky plane in one tile */
+  {
+    bool covered;                        ///< whether the plane covers the whole tile, the rest is only valid then
+    double uv_min[2];                    ///< smallest u and v
+    double uv_max[2];                    ///< largest u and v
+    double uv_step;                      ///< largest change of u or v between neighbouring border pixels
+    float min_lod;                       ///< smallest noise level of detail at the border
+  };
+
+struct terrain_mask       /**< which pixels are terrain and which sky, the same for all the frames of a resolution */
+  {
+    unsigned int width;                  ///< resolution the mask was made for, 0 x 0 for none yet
+    unsigned int height;
+    vector<int> terrain_height;          ///< height of the terrain in each column, 0 for the bottom row
+    vector<unsigned int> sky_rows;       ///< number of the sky pixels at the top of each column, the terrain is under them
+    vector<unsigned int> row_spans;      ///< index into spans of the first sky span of each row, and the number of spans
+    vector<unsigned int> spans;          ///< sky spans of the rows in order, the first column and the column after the last one
+  };
+
+template <typename real> struct cached_plane   /**< geometry of the sky pixels of one sky plane */
+  {
+    vector<real> t;                      ///< line parameter of the hit, negative where the plane isn't hit
+    vector<real> u;                      ///< texturing coordinates of the hit, before the offset of the frame
+    vector<real> v;
+    vector<float> lod;                   ///< noise level of detail of the hit, only with the octave LOD
+
+    void resize(unsigned int pixels, bool lods)
+      {
+        t.resize(pixels); u.resize(pixels); v.resize(pixels); lod.resize(lods ? pixels : 0);
+      }
+  };
+
+struct geometry_cache     /**< geometry of the sky pixels, the same in all the frames of a resolution */
+  {
+    unsigned int width;                  ///< resolution the cache was made for, 0 x 0 for none
+    unsigned int height;
+    unsigned long key;                   ///< hash of the geometry and the settings the cache was made with
+    bool ready;                          ///< whether a whole frame has been cached
+    vector<unsigned int> tile_pixels;    ///< index of the first sky pixel of each tile, the pixels go by tile lines
+    vector<vector<unsigned int> > candidates[2];  ///< triangles of the lower/upper plane each tile may hit
+    vector<tile_uv_bounds> bounds[2];    ///< texturing coordinates of the lower/upper plane in each tile
+    cached_plane<double> planes[2];      ///< the lower/upper plane in the double precision
+    cached_plane<float> planes_float[2]; ///< or in the float one (without the ray traced planes)
+  };
 
 class sky_renderer
   {
     protected:
+      render_statistics statistics;
+      bool octave_lod;                ///< whether the noise octaves are limited by the pixel footprint
+      bool ray_traced_planes;         ///< whether the sky planes are ray traced instead of mapped analytically
+      bool stencil_glow;              ///< whether the sun/moon glow is a blurred stencil instead of the analytic falloff
+      render_precision precision;
+      triangle_bvh layers[2];         ///< geometry of the lower/upper sky plane
+      terrain_mask terrain;           ///< the terrain of the last rendered resolution
+      geometry_cache geometry;        ///< the sky pixel geometry of the last rendered resolution
+      unsigned long geometry_hash;    ///< hash of the triangles of the sky planes
+
+      void setup_plane_mapping(vector<prepared_triangle> *plane, unsigned int width, unsigned int height,
+        vector<triangle_mapping> *mapping);
+        /**<
+          Derives the analytic mapping of the pixels to the points and
+          texturing coordinates of given sky plane, once per frame. It gives
+          the same results as intersecting pixel_ray() rays with the plane
+          triangles, up to the rounding.
+
+          @param plane triangles of the sky plane
+          @param width width of the picture
+          @param height height of the picture
+          @param mapping into this vector the mapping of each triangle will
+                 be written
+          */
+      float pixel_lod(prepared_triangle *triangle, line_3D *line, double t, unsigned int width);
+        /**<
+          Computes the noise level of detail (see
+          perlin_slice::sample_batch_lod) of a pixel on a sky plane, so that
+          the octaves whose lattice cells are smaller than about two pixel
+          footprints are left out, they would only alias.
+
+          @param triangle sky plane triangle hit by the pixel ray
+          @param line the pixel ray made by pixel_ray()
+          @param t line parameter value of the hit
+          @param width width of the picture
+          @return level of detail, HUGE_VALF if the octave LOD is off
+          */
+      void tile_triangles(unsigned int layer, unsigned int width, unsigned int height, unsigned int x0,
+        unsigned int y0, unsigned int x1, unsigned int y1, vector<unsigned int> *candidates);
+        /**<
+          Finds the triangles of a sky plane that the pixel rays of given
+          tile may hit, by the frustum of its corner pixel rays.
+
+          @param layer 0 for the lower sky plane, 1 for the upper one
+          @param width width of the picture
+          @param height height of the picture
+          @param x0 x coordinate of the top left tile pixel
+          @param y0 y coordinate of the top left tile pixel
+          @param x1 x coordinate of the bottom right tile pixel
+          @param y1 y coordinate of the bottom right tile pixel
+          @param candidates into this vector the indices of the triangles
+                 will be written, in the ascending order
+          */
+      void tile_bounds(unsigned int layer, vector<unsigned int> *candidates, vector<triangle_mapping> *mapping,
+        unsigned int width, unsigned int height, unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1,
+        tile_uv_bounds *bounds);
+        /**<
+          Bounds the texturing coordinates of a sky plane in given tile. They
+          are only computed along the tile border and at the triangle
+          vertices inside the tile, each triangle maps its part of the tile
+          to a convex area so the extremes lie there. The bounds are the
+          same in all the frames of a resolution.
+
+          @param layer 0 for the lower sky plane, 1 for the upper one
+          @param candidates triangles of the sky plane the tile may hit,
+                 made by tile_triangles()
+          @param mapping mapping of the sky plane made by
+                 setup_plane_mapping(), NULL to ray trace the plane
+          @param width width of the picture
+          @param height height of the picture
+          @param x0 x coordinate of the top left tile pixel
+          @param y0 y coordinate of the top left tile pixel
+          @param x1 x coordinate of the bottom right tile pixel
+          @param y1 y coordinate of the bottom right tile pixel
+          @param bounds into this variable the bounds will be written
+          */
+      bool tile_is_clear(tile_uv_bounds *bounds, perlin_slice *slice, double uv_shift, double threshold);
+        /**<
+          Checks whether a sky plane surely has no clouds in a tile, so that
+          the cloud pass can be skipped there, by bounding the noise over
+          the range of the texturing coordinates of the tile.
+
+          @param bounds texturing coordinates of the tile made by
+                 tile_bounds()
+          @param slice noise of the sky plane
+          @param uv_shift value added to the texturing coordinates before
+                 wrapping them
+          @param threshold clouds threshold, see cloud_intensity_to_color
+          @return true if the noise is under the threshold in the whole
+                  tile, false if it may not be or the tile isn't covered by
+                  the plane
+          */
+      bool prepare_geometry_cache(unsigned int width, unsigned int height);
+        /**<
+          Makes sure the geometry cache belongs to given resolution and the
+          current geometry and settings, empties it and makes room for a
+          new frame if it doesn't.
+
+          @param width width of the picture
+          @param height height of the picture
+          @return true if the cache is used, false if it would take more
+                  than GEOMETRY_CACHE_LIMIT bytes
+          */
+      template <typename real> void trace_tile(vector<triangle_mapping> *mappings, vector<unsigned int> *candidates[2],
+        bool trace[2], unsigned int width, unsigned int height, unsigned int x0, unsigned int y0, unsigned int x1,
+        unsigned int y1, tile_row *row, cached_plane<real> *planes[2], unsigned int first);
+        /**<
+          Finds the geometry of the sky pixels of a tile, where their rays
+          hit the sky planes and the texturing coordinates there, by the
+          plane mapping in given precision or by the ray tracing.
+
+          @param mappings mapping of the lower and the upper plane made by
+                 setup_plane_mapping(), not used with the ray traced planes
+          @param candidates triangles of the lower/upper plane the tile may
+                 hit, made by tile_triangles()
+          @param trace which of the planes to trace, the other ones are
+                 left as they are
+          @param width width of the picture
+          @param height height of the picture
+          @param x0 x coordinate of the top left tile pixel
+          @param y0 y coordinate of the top left tile pixel
+          @param x1 x coordinate of the bottom right tile pixel
+          @param y1 y coordinate of the bottom right tile pixel
+          @param row helper line of the tile
+          @param planes into these the geometry of the lower/upper plane
+                 will be written
+          @param first index in planes of the first sky pixel of the tile
+          */
+      void update_terrain_mask(unsigned int width, unsigned int height);
+        /**<
+          Makes the terrain mask for given resolution, unless the last one
+          was made for it.
+
+          @param width width of the picture
+          @param height height of the picture
+          */
       void draw_terrain(t_color_buffer *buffer, unsigned char r1, unsigned char g1, unsigned char b1,
-        unsigned char r2, unsigned char g2, unsigned char b2);
+        unsigned char r2, unsigned char g2, unsigned char b2, unsigned int x0, unsigned int y0, unsigned int x1,
+        unsigned int y1);
+        /**<
+          Draws the terrain of the mask in a tile by lines, between its sky
+          spans, in a vertical gradient from the top of each column to the
+          bottom of the picture.
+
+          @param buffer buffer of the resolution of the mask
+          @param r1 red component of the color at the bottom of the picture
+          @param g1 green component of the color at the bottom
+          @param b1 blue component of the color at the bottom
+          @param r2 red component of the color at the top of the terrain
+          @param g2 green component of the color at the top
+          @param b2 blue component of the color at the top
+          @param x0 x coordinate of the top left tile pixel
+          @param y0 y coordinate of the top left tile pixel
+          @param x1 x coordinate of the bottom right tile pixel
+          @param y1 y coordinate of the bottom right tile pixel
+          */
       void make_background_gradient(unsigned char background_color_from[3],unsigned char background_color_to[3], double time_of_day);
         /**<
           Makes a background sky color gradient depending on time of day.
@@ -28,6 +249,27 @@ class sky_renderer
                  be returned
           @param color in this array the [r,g,b] color will be returned
           */
+      bool sphere_rectangle(sphere_3D sphere, unsigned int width, unsigned int height,
+        unsigned int &x0, unsigned int &y0, unsigned int &x1, unsigned int &y1);
+        /**<
+          Projects a sphere (the sun/moon) to the picture and bounds it by
+          a rectangle of pixels. The rays of the pixels outside the
+          rectangle don't hit the sphere. If the sphere isn't whole in
+          front of the camera, the rectangle is the whole picture.
+
+          @param sphere sphere to be bounded
+          @param width width of the picture
+          @param height height of the picture
+          @param x0 in this variable the x coordinate of the top left
+                 pixel of the rectangle will be returned
+          @param y0 in this variable the y coordinate of the top left pixel
+          @param x1 in this variable the x coordinate of the bottom right
+                 pixel
+          @param y1 in this variable the y coordinate of the bottom right
+                 pixel
+          @return false if the sphere is out of the picture (and the
+                  rectangle is empty), true otherwise
+          */
       void draw_stars(t_color_buffer *buffer, unsigned int number_of_stars);
         /**<
           Draws yellow stars on black background into given color buffer.
@@ -36,10 +278,6 @@ class sky_renderer
                  initialised
           @param number of stars number of stras
           */
-      void setup_sky_planes(vector<triangle_3D> *lower_plane, vector<triangle_3D> *upper_plane);
-          /**<
-           Sets up the sky planes.
-           */
       double get_star_intensity(double day_time);
       double get_sun_intensity(double light_directness, double day_time);
           /**<
@@ -50,7 +288,24 @@ class sky_renderer
            @param day_time time of the day
            @return intensity in range <0,1>
            */
-      void fast_blur(t_color_buffer *buffer);
+      void add_sun_glow(t_color_buffer *buffer, sphere_3D sphere, unsigned int radius, unsigned int y,
+        unsigned int x0, unsigned int x1, double intensity);
+          /**<
+           Adds the sun/moon glow to a part of a pixel line. The glow of a
+           pixel is the part of the square of 2 * radius + 1 pixels around
+           it that the sun/moon covers, like in the blurred stencil, but
+           computed from where the pixel columns enter and leave the
+           sun/moon. The sun/moon must be in front of the camera.
+
+           @param buffer buffer to add the glow to
+           @param sphere the sun/moon
+           @param radius radius of the square in pixels
+           @param y y coordinate of the line
+           @param x0 x coordinate of the first pixel
+           @param x1 x coordinate of the pixel after the last one
+           @param intensity glow of a pixel whose whole square is covered,
+                  in range <0,1>
+           */
       void cloud_intensity_to_color(double intensity, double threshold, double cloud_density, unsigned char color[3]);
           /**<
            Maps noise intensity to cloud color.
@@ -64,13 +319,108 @@ class sky_renderer
            @param color in this variable the mapped color will be returned
            */
     public:
+       sky_renderer();
+
+       line_3D pixel_ray(unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+           /**<
+            Makes the primary ray of given pixel.
+
+            @param x x coordinate of the pixel
+            @param y y coordinate of the pixel
+            @param width width of the picture
+            @param height height of the picture
+            @return line going from the camera through the pixel
+            */
+       void setup_sky_planes(vector<triangle_3D> *lower_plane, vector<triangle_3D> *upper_plane);
+           /**<
+            Makes the triangles of the default sky planes, the renderer
+            uses them unless other geometry is set.
+            */
+       void set_geometry(vector<triangle_3D> *lower_plane, vector<triangle_3D> *upper_plane);
+           /**<
+            Sets the triangles of the sky planes, they may make up any
+            shape. A BVH is built over each plane, each pixel shows the
+            closest triangle of the plane its ray hits.
+
+            @param lower_plane triangles of the lower plane, with the
+                   texturing coordinates
+            @param upper_plane triangles of the upper plane
+            */
+       bool load_geometry(const char *filename, unsigned int *error_line);
+           /**<
+            Loads the sky planes from a geometry file and sets them with
+            set_geometry(). The file is a subset of the Wavefront OBJ
+            format in the coordinates of the camera (x to the right, y
+            forward, z down):
+
+              v x y z       a vertex
+              vt u v        texturing coordinates
+              f 1/1 2/2 3/3 a face of the vertices with the texturing
+                            coordinates, 1 based, polygons are split into
+                            triangles by a fan from the first vertex
+              g lower       the following faces make the lower plane
+                            (default), g upper the upper one
+
+            Empty lines, # comments and other statements are ignored.
+
+            @param filename name of the file
+            @param error_line if the file can't be loaded, the number of
+                   the line with an error will be returned in this
+                   variable, 0 if the file can't be read
+            @return true if the file has been loaded, false otherwise (the
+                    geometry then stays the same)
+            */
+       triangle_bvh *get_geometry(unsigned int layer);
+           /**<
+            Gets the geometry of a sky plane.
+
+            @param layer 0 for the lower sky plane, 1 for the upper one
+            */
+
+       void set_octave_lod(bool enabled);
+           /**<
+            Turns the distance based octave LOD on or off (default). With
+            it on the far clouds lose the octaves that would alias, which
+            is faster and gives less shimmering in animations, but the
+            picture is no longer the same as the original one.
+            */
+       void set_ray_traced_planes(bool enabled);
+           /**<
+            Turns the reference mode on or off (default). The sky planes are
+            flat, so by default their pixels are mapped to the texturing
+            coordinates by a homography derived once per frame and stepped
+            along the lines. In the reference mode each pixel ray is
+            intersected with the plane triangles instead, which is slower
+            and serves to validate the mapping.
+            */
+       void set_stencil_glow(bool enabled);
+           /**<
+            Turns the stencil glow on or off (default). By default the glow
+            around the sun/moon is computed for each pixel near it from how
+            much of the window around the pixel it covers. With the stencil
+            glow the sun/moon pixels are drawn into a stencil that is box
+            blurred, which is slower and serves as the reference, the
+            pictures differ slightly. The window grows with the width of
+            the picture, so the glow keeps its size with supersampling.
+            */
+       void set_precision(render_precision precision);
+           /**<
+            Sets the scalar type of the per pixel computations, the mapping
+            of the pixels to the sky planes and their lighting. The scene
+            setup and the ray tracing of the reference mode always use
+            double, the noise always uses float.
+            */
+       render_precision get_precision();
+           /**<
+            Gets the precision set by set_precision(), PRECISION_DOUBLE by
+            default.
+            */
        void render_sky(t_color_buffer *buffer, double time_of_day, double clouds, double density, double offset);
            /**<
-            Renders the sky into given color buffer. The sky is rendered only
-            over white pixels (255,255,255).
+            Renders the terrain and the sky above it into given color buffer.
 
-            @param buffer buffer to render the sky into, it must be initialised
-                   and only white pixels will be redrawn
+            @param buffer buffer to render into, it must be initialised, all
+                   its pixels are redrawn
             @param time_of_day says what time of day it is in range <0,1>,
                    0 meaning midnight, 0.5 noon etc.
             @param clouds how many clouds there should be in range <0,1>
@@ -82,6 +432,21 @@ class sky_renderer
             @param progress_callback pointer to function that will be called
                    after each line rendered, this parameter can be NULL
             */
+       size_t frame_memory(unsigned int width, unsigned int height);
+           /**<
+            Estimates how many bytes render_sky() takes for a frame of given
+            resolution besides the picture, its helper buffers and the
+            caches the renderer keeps, as if all the pixels were sky. A copy
+            of the renderer takes as much for its own frames.
+
+            @param width width of the picture
+            @param height height of the picture
+            @return the number of bytes
+            */
+       render_statistics get_statistics();
+           /**<
+            Gets the statistics of the last render_sky call.
+            */
   };
 
 #endif